@@ -25,17 +25,112 @@
 #include "api.h"
 
 #include <string>
+#include <vector>
+#include <cstring>
+#include <limits>
 
 #include "ppapi/cpp/var_dictionary.h"
+#include "ppapi/cpp/var_array.h"
 #include "ppapi/cpp/core.h"
 
 #include "settings.h"
 #include "instance.h"
+#include "stroke.h"
 
 namespace {
 
 class EInvalidMessage {};
 
+/**
+ * Binary messages are passed as array buffers and consist of a sequence of
+ * records, each made up of a fixed header followed by the payload. All values
+ * are little endian, which is the byte order of all NaCl targets and thus of
+ * the typed arrays on the JS side. The payload length must be a multiple of
+ * four in order to keep the following header aligned.
+ */
+struct BinaryHeader {
+    uint16_t opcode;
+    uint16_t reserved;
+    uint32_t length;
+};
+
+enum BinaryOpcode {
+    // JS -> module: a polyline of BinaryStrokePoint records
+    OPCODE_STROKE = 1,
+    // JS -> module: request a snapshot (empty payload)
+    // module -> JS: a BinarySnapshot followed by the encoded surface
+    OPCODE_SNAPSHOT = 2,
+    // JS -> module: 256 premultiplied RGBA entries, optionally preceded by
+    // the layer as uint32
+    OPCODE_PALETTE = 3,
+    // JS -> module: restore a snapshot, same payload as OPCODE_SNAPSHOT
+    OPCODE_RESTORE = 4,
+    // module -> JS: a BinaryFrame followed by the downsampled planes
+    OPCODE_FRAME = 5
+};
+
+struct BinaryStrokePoint {
+    int16_t x, y;
+    uint16_t radius;
+    uint8_t intensity;
+    uint8_t layer;
+};
+
+/**
+ * A snapshot carries the surface dimensions and the settings, with the decay
+ * settings being those of the first layer. For each further layer, a
+ * BinaryLayerSettings record follows. The planes of the surface follow
+ * run-length encoded (see rle.h), one after the other. Zero layers means one
+ * for compatibility with older snapshots. For an RGB surface, the layer count
+ * is or'ed with snapshot_color_flag and there is a single interleaved plane.
+ */
+struct BinarySnapshot {
+    uint32_t width, height;
+    float bleed, decay_exp, brush_hardness;
+    uint32_t radius;
+    uint8_t decay_lin, fps, brush_intensity, layers;
+    uint32_t length;
+};
+
+struct BinaryLayerSettings {
+    float bleed, decay_exp;
+    uint8_t decay_lin, reserved[3];
+};
+
+/**
+ * A headless frame carries the downsampled size, the layer count (with
+ * snapshot_color_flag for an RGB surface) and the downsampling factor. The
+ * planes follow uncompressed, rows without padding.
+ */
+struct BinaryFrame {
+    uint32_t width, height;
+    uint8_t layers, downsample, reserved[2];
+    uint32_t length;
+};
+
+const uint8_t snapshot_color_flag = 0x80;
+
+const uint32_t palette_size = 256;
+
+/**
+ * The keys used for the telemetry values in the outbound message.
+ */
+const char* gauge_keys[] = {
+    "processingFps",
+    "renderingFps",
+    "latency",
+    "qualityLevel",
+    "displayLatency",
+    "jitter",
+    "maxJitter"
+};
+
+const char* counter_keys[] = {
+    "strokePoints"
+};
+
+const uint32_t counter_dirty_shift = 16;
+
 /**
  * The following helpers try to unwrap a value from the message. JS values are
  * represented by pp::Var instances, which we have to typecheck before
@@ -77,6 +172,75 @@ int32_t MessageGetInt(
     return value.AsInt();
 }
 
+bool MessageGetBool(
+    const pp::VarDictionary& msg,
+    const std::string& name)
+{
+    if (!msg.HasKey(name)) throw EInvalidMessage();
+
+    pp::Var value = msg.Get(name);
+    if (!value.is_bool()) throw EInvalidMessage();
+
+    return value.AsBool();
+}
+
+pp::VarArray MessageGetArray(
+    const pp::VarDictionary& msg,
+    const std::string& name)
+{
+    if (!msg.HasKey(name)) throw EInvalidMessage();
+
+    pp::Var value = msg.Get(name);
+    if (!value.is_array()) throw EInvalidMessage();
+
+    return pp::VarArray(value);
+}
+
+template<typename T> T constrain(T value, T min, T max) {
+    if (value < min) return min;
+    if (value > max) return max;
+    return value;
+}
+
+/**
+ * Convert a JS number to an integer within [min, max]. The value is clamped
+ * before the conversion, as converting an out-of-range double is undefined.
+ * NaN is rejected.
+ */
+int32_t NumberToInt(double value, int32_t min, int32_t max) {
+    if (value != value) throw EInvalidMessage();
+
+    if (value < min) return min;
+    if (value > max) return max;
+    return static_cast<int32_t>(value);
+}
+
+/**
+ * False for NaN and infinity, which binary records may carry.
+ */
+bool IsFinite(float value) {
+    return value - value == 0;
+}
+
+/**
+ * Per-point stroke attributes may either be given as an array with one entry
+ * per point or as a single number which applies to all points.
+ */
+int32_t StrokeAttribute(
+    const pp::Var& attribute,
+    uint32_t index,
+    int32_t default_value,
+    int32_t max)
+{
+    if (attribute.is_undefined()) return constrain(default_value, 0, max);
+    if (attribute.is_number()) return NumberToInt(attribute.AsDouble(), 0, max);
+
+    pp::Var value = pp::VarArray(attribute).Get(index);
+    if (!value.is_number()) throw EInvalidMessage();
+
+    return NumberToInt(value.AsDouble(), 0, max);
+}
+
 /**
  * Build an error message. The original message is returned in the
  * originalMessage field.
@@ -108,17 +272,35 @@ pp::VarDictionary BuildSettingsMessage(const glow::Settings& settings) {
     // the pp::Var constructor to convert our atomic value into a pp::Var, we
     // better cast it explicitly to the desired type in order to avoid nasty
     // surprises.
+    message.Set("layers",   static_cast<int32_t>(settings.Layers()));
+    message.Set("layer",    static_cast<int32_t>(settings.Layer()));
+    message.Set("color",    settings.Color());
     message.Set("bleed",    static_cast<double>(settings.Bleed()));
     message.Set("decayLin", static_cast<int32_t>(settings.Decay_lin()));
     message.Set("decayExp", static_cast<double>(settings.Decay_exp()));
     message.Set("radius",   static_cast<int32_t>(settings.Radius()));
     message.Set("fps",      static_cast<int32_t>(settings.Fps()));
+    message.Set("brushHardness",
+        static_cast<double>(settings.Brush_hardness()));
+    message.Set("brushIntensity",
+        static_cast<int32_t>(settings.Brush_intensity()));
+    message.Set("brushColor",
+        static_cast<int32_t>(settings.Brush_color()));
+    message.Set("broadcastInterval",
+        static_cast<int32_t>(settings.Broadcast_interval()));
+    message.Set("throttle", settings.Throttle());
+    message.Set("frameInterval",
+        static_cast<int32_t>(settings.Frame_interval()));
+    message.Set("frameDownsample",
+        static_cast<int32_t>(settings.Frame_downsample()));
+    message.Set("threadPriority", settings.Thread_priority());
 
     return message;
 }
 
 /**
- * Apply a settings change request.
+ * Apply a settings change request. Bleed and decay refer to the active layer,
+ * so a layer change is applied first.
  */
 void ApplyChangeSettingsMessage(
     const pp::VarDictionary& message,
@@ -126,6 +308,9 @@ void ApplyChangeSettingsMessage(
 {
     glow::Settings newSettings(settings);
 
+    if (message.HasKey("layer")) {
+        newSettings.Layer(MessageGetInt(message, "layer"));
+    }
     if (message.HasKey("radius")) {
         newSettings.Radius(MessageGetInt(message, "radius"));
     }
@@ -138,22 +323,106 @@ void ApplyChangeSettingsMessage(
     if (message.HasKey("decayLin")) {
         newSettings.Decay_lin(MessageGetInt(message, "decayLin"));
     }
+    if (message.HasKey("brushHardness")) {
+        newSettings.Brush_hardness(MessageGetFloat(message, "brushHardness"));
+    }
+    if (message.HasKey("brushIntensity")) {
+        newSettings.Brush_intensity(MessageGetInt(message, "brushIntensity"));
+    }
+    if (message.HasKey("brushColor")) {
+        newSettings.Brush_color(MessageGetInt(message, "brushColor"));
+    }
     if (message.HasKey("fps")) {
         newSettings.Fps(MessageGetInt(message, "fps"));
     }
+    if (message.HasKey("broadcastInterval")) {
+        newSettings.Broadcast_interval(
+            MessageGetInt(message, "broadcastInterval"));
+    }
+    if (message.HasKey("throttle")) {
+        newSettings.Throttle(MessageGetBool(message, "throttle"));
+    }
+    if (message.HasKey("frameInterval")) {
+        newSettings.Frame_interval(MessageGetInt(message, "frameInterval"));
+    }
+    if (message.HasKey("frameDownsample")) {
+        newSettings.Frame_downsample(
+            MessageGetInt(message, "frameDownsample"));
+    }
+    if (message.HasKey("threadPriority")) {
+        newSettings.Thread_priority(MessageGetInt(message, "threadPriority"));
+    }
 
     settings = newSettings;
 }
 
+/**
+ * Unwrap a stroke. The points are passed as a flat array of coordinates
+ * (x1, y1, x2, y2, ...), while radius, intensity and layer are optional. The
+ * layer applies to the whole stroke and defaults to the active layer.
+ */
+void UnwrapStrokeMessage(
+    const pp::VarDictionary& message,
+    const glow::Settings& settings,
+    glow::Stroke& stroke)
+{
+    pp::VarArray points = MessageGetArray(message, "points");
+    uint32_t length = points.GetLength();
+
+    if (length % 2 != 0) throw EInvalidMessage();
+
+    pp::Var radius = message.Get("radius"),
+            intensity = message.Get("intensity");
+
+    uint32_t layer = settings.Layer();
+    if (message.HasKey("layer")) {
+        layer = constrain<int32_t>(MessageGetInt(message, "layer"),
+            0, settings.Layers() - 1);
+    }
+
+    if (!(radius.is_undefined() || radius.is_number() || radius.is_array()) ||
+        !(intensity.is_undefined() || intensity.is_number() ||
+            intensity.is_array()))
+    {
+        throw EInvalidMessage();
+    }
+
+    stroke.resize(length / 2);
+
+    // Coordinates far off the surface are clipped by the brush, so clamping
+    // them to the integer range only matters for absurd values.
+    const int32_t coordinate_min = std::numeric_limits<int32_t>::min(),
+                  coordinate_max = std::numeric_limits<int32_t>::max();
+
+    for (uint32_t i = 0; i < stroke.size(); i++) {
+        pp::Var x = points.Get(2 * i), y = points.Get(2 * i + 1);
+        if (!x.is_number() || !y.is_number()) throw EInvalidMessage();
+
+        stroke[i].x = NumberToInt(x.AsDouble(), coordinate_min, coordinate_max);
+        stroke[i].y = NumberToInt(y.AsDouble(), coordinate_min, coordinate_max);
+        stroke[i].radius = StrokeAttribute(
+            radius, i, settings.Radius(), glow::Settings::max_radius);
+        stroke[i].intensity = StrokeAttribute(
+            intensity, i, settings.Brush_intensity(), 255);
+        stroke[i].layer = layer;
+    }
+}
+
 }
 
 namespace glow {
 
 Api::Api(Instance& instance) :
-    instance(instance)
+    instance(instance),
+    dirty(0)
 {
+    for (uint32_t i = 0; i < GAUGE_COUNT; i++) gauges[i] = 0;
+    for (uint32_t i = 0; i < COUNTER_COUNT; i++) counters[i] = 0;
+
     // Initialize the callback factory
     callback_factory = new pp::CompletionCallbackFactory<Api>(this);
+
+    ScheduleTelemetryFlush();
 }
 
 Api::~Api() {
@@ -168,6 +437,16 @@ Api::~Api() {
  * PostMessage directly).
  */
 void Api::HandleMessage(const pp::Var& message) {
+    // Binary messages take a separate path which doesn't rely on exceptions.
+    if (message.is_array_buffer()) {
+        if (!HandleBinaryMessage(pp::VarArrayBuffer(message))) {
+            // We don't return the original message here as it may be huge.
+            instance.PostMessage(BuildErrorMessage("invalid binary message"));
+        }
+
+        return;
+    }
+
     try {
         if (!message.is_dictionary()) throw EInvalidMessage();
         // pp::VarDictionary is the data type which represents JS objects.
@@ -185,6 +464,31 @@ void Api::HandleMessage(const pp::Var& message) {
             // them to the settings object.
             ApplyChangeSettingsMessage(msg, instance.GetSettings());
 
+        } else if (subject == "drawStroke") {
+            // The whole stroke is handed to the renderer as one batch.
+            Stroke stroke;
+            UnwrapStrokeMessage(msg, instance.GetSettings(), stroke);
+
+            Renderer* renderer = instance.GetRenderer();
+            if (renderer != NULL && !stroke.empty()) renderer->DrawStroke(stroke);
+
+        } else if (subject == "startTrace") {
+            instance.GetTracer().Start();
+
+        } else if (subject == "stopTrace") {
+            instance.GetTracer().Stop();
+
+        } else if (subject == "requestTrace") {
+            // The trace is passed as a string, so it can be saved and loaded
+            // into chrome://tracing as is.
+            std::string trace;
+            instance.GetTracer().Dump(trace);
+
+            pp::VarDictionary reply;
+            reply.Set("subject", "trace");
+            reply.Set("trace", trace);
+            instance.PostMessage(reply);
+
         } else {
             throw EInvalidMessage();
         }
@@ -196,23 +500,359 @@ void Api::HandleMessage(const pp::Var& message) {
 }
 
 /**
- * Broadcast the current FPS to the JS side. This will be called from the
- * renderer thread and thus we cannot call PostMessage directly but have to
- * schedule a callback on the main thread instead.
+ * Update a gauge. This may be called from any thread. The value is stored
+ * before the dirty flag is raised, so the flush never misses an update.
+ */
+void Api::SetGauge(Gauge gauge, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    gauges[gauge] = bits;
+    __sync_fetch_and_or(&dirty, 1 << gauge);
+}
+
+/**
+ * See above.
+ */
+void Api::IncrementCounter(Counter counter, uint32_t amount) {
+    __sync_fetch_and_add(&counters[counter], amount);
+    __sync_fetch_and_or(&dirty, 1 << (counter + counter_dirty_shift));
+}
+
+/**
+ * pp::Core::CallOnMainThread schedules a callback on the main thread's
+ * message loop after the given delay.
+ */
+void Api::ScheduleTelemetryFlush() {
+    pp::Module::Get()->core()->CallOnMainThread(
+        instance.GetSettings().Broadcast_interval(),
+        callback_factory->NewCallback(&Api::FlushTelemetry));
+}
+
+/**
+ * Coalesce all telemetry touched since the last flush into a single message.
+ * As we are on the main thread, we can call PostMessage directly.
+ */
+void Api::FlushTelemetry(uint32_t result) {
+    if (result != PP_OK) return;
+
+    uint32_t flags = __sync_fetch_and_and(&dirty, 0);
+
+    if (flags != 0) {
+        pp::VarDictionary msg;
+        msg.Set("subject", "telemetry");
+
+        for (uint32_t i = 0; i < GAUGE_COUNT; i++) {
+            if (!(flags & (1 << i))) continue;
+
+            uint32_t bits = gauges[i];
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+
+            msg.Set(gauge_keys[i], static_cast<double>(value));
+        }
+
+        for (uint32_t i = 0; i < COUNTER_COUNT; i++) {
+            if (!(flags & (1 << (i + counter_dirty_shift)))) continue;
+
+            msg.Set(counter_keys[i],
+                static_cast<int32_t>(__sync_fetch_and_and(&counters[i], 0)));
+        }
+
+        instance.PostMessage(msg);
+    }
+
+    ScheduleTelemetryFlush();
+}
+
+/**
+ * Send an encoded snapshot of the surface to the JS side together with the
+ * current settings. This is called from the renderer thread and thus we
+ * cannot call PostMessage directly but have to schedule a callback on the
+ * main thread instead.
+ */
+void Api::BroadcastSnapshot(
+    uint32_t width,
+    uint32_t height,
+    const uint8_t* encoded,
+    uint32_t length)
+{
+    const Settings& settings(instance.GetSettings());
+    BinaryHeader header;
+    BinarySnapshot snapshot;
+
+    uint32_t layers = settings.Layers(),
+             settings_length = sizeof(snapshot) +
+                (layers - 1) * sizeof(BinaryLayerSettings);
+
+    header.opcode = OPCODE_SNAPSHOT;
+    header.reserved = 0;
+    header.length = (settings_length + length + 3) & ~3;
+
+    snapshot.width = width;
+    snapshot.height = height;
+    snapshot.bleed = settings.Layer_bleed(0);
+    snapshot.decay_exp = settings.Layer_decay_exp(0);
+    snapshot.brush_hardness = settings.Brush_hardness();
+    snapshot.radius = settings.Radius();
+    snapshot.decay_lin = settings.Layer_decay_lin(0);
+    snapshot.fps = settings.Fps();
+    snapshot.brush_intensity = settings.Brush_intensity();
+    snapshot.layers = layers | (settings.Color() ? snapshot_color_flag : 0);
+    snapshot.length = length;
+
+    pp::VarArrayBuffer msg(sizeof(header) + header.length);
+    uint8_t* data = static_cast<uint8_t*>(msg.Map());
+
+    uint8_t* payload = data + sizeof(header);
+
+    memcpy(data, &header, sizeof(header));
+    memcpy(payload, &snapshot, sizeof(snapshot));
+
+    for (uint32_t i = 1; i < layers; i++) {
+        BinaryLayerSettings layer_settings;
+
+        layer_settings.bleed = settings.Layer_bleed(i);
+        layer_settings.decay_exp = settings.Layer_decay_exp(i);
+        layer_settings.decay_lin = settings.Layer_decay_lin(i);
+        memset(layer_settings.reserved, 0, sizeof(layer_settings.reserved));
+
+        memcpy(payload + sizeof(snapshot) + (i - 1) * sizeof(layer_settings),
+            &layer_settings, sizeof(layer_settings));
+    }
+
+    memcpy(payload + settings_length, encoded, length);
+
+    // Zero the padding
+    memset(payload + settings_length + length, 0,
+        header.length - settings_length - length);
+
+    msg.Unmap();
+
+    pp::Module::Get()->core()->CallOnMainThread(0,
+        callback_factory->NewCallback(&Api::DoPostMessage, msg));
+}
+
+/**
+ * Called from the presentation thread in headless mode.
  */
-void Api::BroadcastFps(float processing_fps, float rendering_fps) {
-    pp::VarDictionary msg;
+void Api::BroadcastFrame(
+    uint32_t width,
+    uint32_t height,
+    uint32_t downsample,
+    const uint8_t* data,
+    uint32_t length)
+{
+    const Settings& settings(instance.GetSettings());
+    BinaryHeader header;
+    BinaryFrame frame;
+
+    header.opcode = OPCODE_FRAME;
+    header.reserved = 0;
+    header.length = (sizeof(frame) + length + 3) & ~3;
+
+    frame.width = width;
+    frame.height = height;
+    frame.layers = settings.Layers() |
+        (settings.Color() ? snapshot_color_flag : 0);
+    frame.downsample = downsample;
+    frame.reserved[0] = frame.reserved[1] = 0;
+    frame.length = length;
+
+    pp::VarArrayBuffer msg(sizeof(header) + header.length);
+    uint8_t* payload = static_cast<uint8_t*>(msg.Map());
+
+    memcpy(payload, &header, sizeof(header));
+    payload += sizeof(header);
+
+    memcpy(payload, &frame, sizeof(frame));
+    memcpy(payload + sizeof(frame), data, length);
+    memset(payload + sizeof(frame) + length, 0,
+        header.length - sizeof(frame) - length);
 
-    msg.Set("subject", "fpsBroadcast");
-    msg.Set("processingFps", static_cast<double>(processing_fps));
-    msg.Set("renderingFps", static_cast<double>(rendering_fps));
+    msg.Unmap();
 
-    // pp::Core::CallOnMainThread schedules a callback on the main thread's
-    // message loop.
     pp::Module::Get()->core()->CallOnMainThread(0,
         callback_factory->NewCallback(&Api::DoPostMessage, msg));
 }
 
+/**
+ * Apply the settings from a snapshot and hand the surface data to the
+ * renderer, which decodes it on the rendering thread.
+ */
+bool Api::RestoreSnapshot(const uint8_t* payload, uint32_t length) {
+    BinarySnapshot snapshot;
+
+    if (length < sizeof(snapshot)) return false;
+    memcpy(&snapshot, payload, sizeof(snapshot));
+
+    Settings& settings(instance.GetSettings());
+    bool color = (snapshot.layers & snapshot_color_flag) != 0;
+    uint32_t layers = snapshot.layers & ~snapshot_color_flag,
+             settings_length;
+
+    if (layers == 0) layers = 1;
+    settings_length = sizeof(snapshot) +
+        (layers - 1) * sizeof(BinaryLayerSettings);
+
+    // The layer count and mode are fixed while the module is running.
+    if (layers != settings.Layers() || color != settings.Color()) return false;
+    if (length < settings_length ||
+        snapshot.length > length - settings_length)
+    {
+        return false;
+    }
+
+    // The setters clamp the values, but NaN would slip through.
+    if (!IsFinite(snapshot.bleed) || !IsFinite(snapshot.decay_exp) ||
+        !IsFinite(snapshot.brush_hardness))
+    {
+        return false;
+    }
+
+    Settings newSettings(settings);
+
+    newSettings
+        .Layer_bleed(0, snapshot.bleed)
+        .Layer_decay_exp(0, snapshot.decay_exp)
+        .Brush_hardness(snapshot.brush_hardness)
+        .Radius(snapshot.radius)
+        .Layer_decay_lin(0, snapshot.decay_lin)
+        .Fps(snapshot.fps > 0 ? snapshot.fps : settings.Fps())
+        .Brush_intensity(snapshot.brush_intensity);
+
+    for (uint32_t i = 1; i < layers; i++) {
+        BinaryLayerSettings layer_settings;
+
+        memcpy(&layer_settings,
+            payload + sizeof(snapshot) + (i - 1) * sizeof(layer_settings),
+            sizeof(layer_settings));
+
+        if (!IsFinite(layer_settings.bleed) ||
+            !IsFinite(layer_settings.decay_exp))
+        {
+            return false;
+        }
+
+        newSettings
+            .Layer_bleed(i, layer_settings.bleed)
+            .Layer_decay_exp(i, layer_settings.decay_exp)
+            .Layer_decay_lin(i, layer_settings.decay_lin);
+    }
+
+    settings = newSettings;
+
+    Renderer* renderer = instance.GetRenderer();
+    if (renderer != NULL) {
+        const uint8_t* encoded = payload + settings_length;
+
+        renderer->RestoreSnapshot(
+            snapshot.width, snapshot.height,
+            std::vector<uint8_t>(encoded, encoded + snapshot.length)
+        );
+    }
+
+    return true;
+}
+
+/**
+ * Walk the records of a binary message. Returns false if the message is
+ * malformed; records preceding the offending one have already been applied
+ * in this case.
+ */
+bool Api::HandleBinaryMessage(pp::VarArrayBuffer message) {
+    uint32_t size = message.ByteLength(),
+             offset = 0;
+    const uint8_t* data = static_cast<const uint8_t*>(message.Map());
+    bool success = data != NULL;
+
+    while (success && offset < size) {
+        BinaryHeader header;
+
+        if (size - offset < sizeof(header)) {
+            success = false;
+            break;
+        }
+
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+
+        if (header.length > size - offset || header.length % 4 != 0) {
+            success = false;
+            break;
+        }
+
+        success = HandleBinaryRecord(header.opcode, data + offset, header.length);
+        offset += header.length;
+    }
+
+    message.Unmap();
+
+    return success;
+}
+
+bool Api::HandleBinaryRecord(
+    uint16_t opcode,
+    const uint8_t* payload,
+    uint32_t length)
+{
+    Renderer* renderer = instance.GetRenderer();
+
+    switch (opcode) {
+        case OPCODE_STROKE:
+            {
+                uint32_t count = length / sizeof(BinaryStrokePoint),
+                         max_layer = instance.GetSettings().Layers() - 1;
+                Stroke stroke(count);
+
+                for (uint32_t i = 0; i < count; i++) {
+                    BinaryStrokePoint point;
+                    memcpy(&point, payload + i * sizeof(point), sizeof(point));
+
+                    stroke[i].x = point.x;
+                    stroke[i].y = point.y;
+                    stroke[i].radius = point.radius > Settings::max_radius ?
+                        Settings::max_radius : point.radius;
+                    stroke[i].intensity = point.intensity;
+                    stroke[i].layer = point.layer > max_layer ?
+                        max_layer : point.layer;
+                }
+
+                if (renderer != NULL && count > 0) renderer->DrawStroke(stroke);
+            }
+            return true;
+
+        case OPCODE_SNAPSHOT:
+            if (renderer != NULL) renderer->RequestSnapshot();
+            return true;
+
+        case OPCODE_RESTORE:
+            return RestoreSnapshot(payload, length);
+
+        case OPCODE_PALETTE:
+            {
+                uint32_t layer = 0;
+
+                if (length == (palette_size + 1) * sizeof(uint32_t)) {
+                    memcpy(&layer, payload, sizeof(layer));
+                    payload += sizeof(layer);
+                    length -= sizeof(layer);
+                }
+
+                if (length != palette_size * sizeof(uint32_t)) return false;
+
+                std::vector<uint32_t> palette(palette_size);
+                memcpy(&palette[0], payload, length);
+
+                if (renderer != NULL) renderer->SetPalette(layer, palette);
+            }
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 /*
  * Call PostMessage on the main thread.
  */
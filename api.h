@@ -25,7 +25,10 @@
 #ifndef GLOW_API_H
 #define GLOW_API_H
 
+#include <stdint.h>
+
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/utility/completion_callback_factory.h"
 
 namespace glow {
@@ -44,7 +47,51 @@ class Api {
 
         void HandleMessage(const pp::Var& message);
 
-        void BroadcastFps(float processing_fps, float rendering_fps);
+        /**
+         * Telemetry is collected from the renderer threads without locking
+         * and flushed to the JS side as a single message at a configurable
+         * interval. Gauges report the latest value, while counters are summed
+         * up between two flushes. Only values which have been touched since
+         * the last flush are sent.
+         */
+        enum Gauge {
+            GAUGE_PROCESSING_FPS,
+            GAUGE_RENDERING_FPS,
+            GAUGE_LATENCY,
+            GAUGE_QUALITY_LEVEL,
+            GAUGE_DISPLAY_LATENCY,
+            GAUGE_JITTER,
+            GAUGE_MAX_JITTER,
+            GAUGE_COUNT
+        };
+
+        enum Counter {
+            COUNTER_STROKE_POINTS,
+            COUNTER_COUNT
+        };
+
+        void SetGauge(Gauge gauge, float value);
+        void IncrementCounter(Counter counter, uint32_t amount = 1);
+
+        void BroadcastSnapshot(
+            uint32_t width,
+            uint32_t height,
+            const uint8_t* encoded,
+            uint32_t length
+        );
+
+        /**
+         * Deliver a downsampled frame in headless mode. The data holds the
+         * planes of the surface back to back, each row width times the
+         * number of channels in size.
+         */
+        void BroadcastFrame(
+            uint32_t width,
+            uint32_t height,
+            uint32_t downsample,
+            const uint8_t* data,
+            uint32_t length
+        );
 
     private:
 
@@ -58,8 +105,27 @@ class Api {
          */
         pp::CompletionCallbackFactory<Api>* callback_factory;
 
+        /**
+         * Gauges are stored as raw float bits. The lower bits of the dirty
+         * mask correspond to the gauges, the upper ones to the counters.
+         */
+        volatile uint32_t gauges[GAUGE_COUNT];
+        volatile uint32_t counters[COUNTER_COUNT];
+        volatile uint32_t dirty;
+
         void DoPostMessage(uint32_t result, const pp::Var& message);
 
+        void ScheduleTelemetryFlush();
+        void FlushTelemetry(uint32_t result);
+
+        bool HandleBinaryMessage(pp::VarArrayBuffer message);
+        bool HandleBinaryRecord(
+            uint16_t opcode,
+            const uint8_t* payload,
+            uint32_t length
+        );
+        bool RestoreSnapshot(const uint8_t* payload, uint32_t length);
+
         Api(const Api&);
         const Api& operator=(const Api&);
 };
@@ -0,0 +1,223 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "brush.h"
+
+#include <cmath>
+
+namespace {
+
+float Coverage(float distance, float r, float hardness) {
+    // The kernel is solid up to hardness * r and fades out until just
+    // beyond the radius. Smoothstep makes the falloff look softer.
+    float width = r + 0.5 - hardness * r,
+          coverage = (r + 0.5 - distance) / width;
+
+    if (coverage <= 0) return 0;
+    if (coverage >= 1) return 1;
+
+    return coverage * coverage * (3 - 2 * coverage);
+}
+
+/**
+ * False for NaN and infinity.
+ */
+inline bool IsFinite(float value) {
+    return value - value == 0;
+}
+
+/**
+ * Narrow the parameter range [t0, t1] of p + t * d to the part within
+ * [low, high] and return whether anything is left.
+ */
+bool ClipAxis(float p, float d, float low, float high, float& t0, float& t1) {
+    if (d == 0) return p >= low && p <= high;
+
+    float a = (low - p) / d,
+          b = (high - p) / d;
+
+    if (a > b) {
+        float swap = a;
+        a = b;
+        b = swap;
+    }
+
+    if (a > t0) t0 = a;
+    if (b < t1) t1 = b;
+
+    return t0 <= t1;
+}
+
+}
+
+namespace glow {
+
+Brush::Brush() :
+    hardness(1),
+    kernels(max_radius + 1, static_cast<KernelSet*>(NULL))
+{}
+
+Brush::~Brush() {
+    Clear();
+}
+
+void Brush::SetHardness(float new_hardness) {
+    if (new_hardness == hardness) return;
+
+    hardness = new_hardness;
+    Clear();
+}
+
+void Brush::Clear() {
+    for (uint32_t i = 0; i < kernels.size(); i++) {
+        delete kernels[i];
+        kernels[i] = NULL;
+    }
+}
+
+const Brush::KernelSet& Brush::GetKernelSet(uint32_t r) {
+    if (r > max_radius) r = max_radius;
+    if (kernels[r] == NULL) kernels[r] = BuildKernelSet(r);
+
+    return *kernels[r];
+}
+
+/**
+ * The kernels for all sub-pixel offsets are stored back to back. A kernel
+ * is a square of size * size coverage values, the brush center sits at
+ * (r + 1 + offset) in both directions.
+ */
+Brush::KernelSet* Brush::BuildKernelSet(uint32_t r) const {
+    KernelSet* set = new KernelSet();
+
+    set->size = 2 * r + 3;
+    set->phases = r <= subpixel_max_radius ? subpixel_steps : 1;
+    set->data.resize(set->size * set->size * set->phases * set->phases);
+
+    uint8_t* kernel = &set->data[0];
+
+    for (uint32_t py = 0; py < set->phases; py++) {
+        for (uint32_t px = 0; px < set->phases; px++) {
+            float cx = r + 1 + static_cast<float>(px) / set->phases,
+                  cy = r + 1 + static_cast<float>(py) / set->phases;
+
+            for (uint32_t y = 0; y < set->size; y++) {
+                for (uint32_t x = 0; x < set->size; x++) {
+                    float distance = sqrtf((x - cx) * (x - cx) + (y - cy) * (y - cy));
+                    *kernel++ = nearbyint(255 * Coverage(distance, r, hardness));
+                }
+            }
+        }
+    }
+
+    return set;
+}
+
+void Brush::Dot(
+    Surface& surface,
+    float x, float y,
+    uint32_t r, uint8_t intensity)
+{
+    const KernelSet& set(GetKernelSet(r));
+
+    // Dots which can't touch the surface are dropped before the position is
+    // converted to integers. This also rejects NaN.
+    float margin = set.size;
+
+    if (!(x > -margin && x < surface.GetWidth() + margin &&
+          y > -margin && y < surface.GetHeight() + margin))
+    {
+        return;
+    }
+
+    // Split the position into the integer part and the sub-pixel phase.
+    float fx = floorf(x), fy = floorf(y);
+    uint32_t px = static_cast<uint32_t>((x - fx) * set.phases),
+             py = static_cast<uint32_t>((y - fy) * set.phases);
+
+    if (px >= set.phases) px = set.phases - 1;
+    if (py >= set.phases) py = set.phases - 1;
+
+    uint32_t kernel_area = set.size * set.size;
+    const uint8_t* kernel =
+        &set.data[(py * set.phases + px) * kernel_area];
+
+    int32_t origin = static_cast<int32_t>(set.size / 2);
+
+    surface.Stamp(
+        kernel, set.size,
+        static_cast<int32_t>(fx) - origin, static_cast<int32_t>(fy) - origin,
+        intensity
+    );
+}
+
+/**
+ * Lines are drawn by stamping the kernel at regular intervals. As the
+ * kernels are blended with max, the step can grow with the radius without
+ * visible scalloping, which keeps the cost of thick lines down.
+ *
+ * The line is clipped to the area in which a stamp can touch the surface
+ * first, so the cost is bounded by the surface size regardless of the
+ * coordinates. The start point itself is not stamped, unless it has been
+ * clipped away.
+ */
+void Brush::Line(
+    Surface& surface,
+    float x1, float y1, float x2, float y2,
+    uint32_t r, uint8_t intensity)
+{
+    if (r > max_radius) r = max_radius;
+
+    float dx = x2 - x1,
+          dy = y2 - y1,
+          margin = 2 * r + 3,
+          t0 = 0,
+          t1 = 1;
+
+    if (!IsFinite(dx) || !IsFinite(dy) ||
+        !ClipAxis(x1, dx, -margin, surface.GetWidth() + margin, t0, t1) ||
+        !ClipAxis(y1, dy, -margin, surface.GetHeight() + margin, t0, t1))
+    {
+        return;
+    }
+
+    float sx = x1 + t0 * dx,
+          sy = y1 + t0 * dy;
+
+    dx *= t1 - t0;
+    dy *= t1 - t0;
+
+    float length = sqrtf(dx * dx + dy * dy),
+          step = r > 4 ? r / 4. : 1.;
+
+    uint32_t steps = static_cast<uint32_t>(ceilf(length / step));
+    if (steps == 0) steps = 1;
+
+    for (uint32_t i = t0 > 0 ? 0 : 1; i <= steps; i++) {
+        float t = static_cast<float>(i) / steps;
+        Dot(surface, sx + t * dx, sy + t * dy, r, intensity);
+    }
+}
+
+}
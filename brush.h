@@ -0,0 +1,100 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_BRUSH_H
+#define GLOW_BRUSH_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "surface.h"
+
+namespace glow {
+
+/**
+ * The Brush class draws anti-aliased dots and lines onto a surface. For each
+ * radius, a set of coverage kernels is precomputed on first use: one for
+ * each sub-pixel offset of the brush center. Drawing then boils down to
+ * blending the kernel rows into the surface. The kernels are rebuilt if the
+ * hardness changes.
+ */
+class Brush {
+    public:
+
+        Brush();
+        ~Brush();
+
+        /**
+         * Hardness ranges from zero (the intensity falls off linearly from the
+         * center) to one (a solid disc with an anti-aliased edge).
+         */
+        void SetHardness(float hardness);
+
+        float GetHardness() const {
+            return hardness;
+        }
+
+        void Dot(
+            Surface& surface,
+            float x, float y,
+            uint32_t r, uint8_t intensity
+        );
+
+        void Line(
+            Surface& surface,
+            float x1, float y1, float x2, float y2,
+            uint32_t r, uint8_t intensity
+        );
+
+        static const uint32_t max_radius = 255;
+
+    private:
+
+        /**
+         * Sub-pixel resolution of the kernels. Above a certain radius, the
+         * offset makes no visible difference, so we only build one kernel.
+         */
+        static const uint32_t subpixel_steps = 4;
+        static const uint32_t subpixel_max_radius = 16;
+
+        struct KernelSet {
+            uint32_t size;
+            uint32_t phases;
+            std::vector<uint8_t> data;
+        };
+
+        float hardness;
+        std::vector<KernelSet*> kernels;
+
+        const KernelSet& GetKernelSet(uint32_t r);
+        KernelSet* BuildKernelSet(uint32_t r) const;
+        void Clear();
+
+        Brush(const Brush&);
+        const Brush& operator=(const Brush&);
+};
+
+}
+
+#endif // GLOW_BRUSH_H
@@ -22,26 +22,14 @@
  * THE SOFTWARE.
  */
 
+#include "module.h"
 #include "instance.h"
 
 namespace glow {
 
-/**
- * Every NaCl program must define a module class which derives from pp::Module
- * and implements the CreateInstance factory method.
- */
-class Module : public pp::Module {
-    public:
-
-        /**
-         * The actual program logic goes into an Instance class which extends
-         * pp::Instance. This method has to be implemented and works as a factory
-         * for new Instance instances.
-         */
-        virtual pp::Instance* CreateInstance(PP_Instance instance) {
-            return new Instance(instance);
-        }
-};
+pp::Instance* Module::CreateInstance(PP_Instance instance) {
+    return new Instance(instance);
+}
 
 }
 
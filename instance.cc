@@ -24,43 +24,97 @@
 
 #include "instance.h"
 
+#include <cstdlib>
+
 namespace glow {
 
 Instance::Instance(PP_Instance instance) :
     pp::Instance(instance),
     graphics(NULL),
     renderer(NULL),
-    drawing(false)
+    drawing(false),
+    tracer(instance)
 {
     logger = new Logger(*this);
     api = new Api(*this);
 
     // This method must be called in order to subscribe to different
     // classes of input events.
-    RequestInputEvents(PP_INPUTEVENT_CLASS_MOUSE);
+    RequestInputEvents(PP_INPUTEVENT_CLASS_MOUSE | PP_INPUTEVENT_CLASS_TOUCH);
 }
 
 Instance::~Instance() {
-    if (graphics != NULL) delete graphics;
+    // Deleting the renderer waits for the worker to detach it, including
+    // any present or flush still in flight, so the graphics context must
+    // outlive it.
     if (renderer != NULL) delete renderer;
+    if (graphics != NULL) delete graphics;
     if (api != NULL) delete api;
+
+    // The renderer logs while stopping, so the logger goes last.
+    delete logger;
+}
+
+/**
+ * If the embed tag carries a persist attribute, the surface is persisted in a
+ * file of that name. The layers attribute sets the number of layers, and a
+ * color attribute switches to an RGB surface. A headless attribute of the form
+ * WIDTHxHEIGHT runs the renderer without display on a surface of that size.
+ */
+bool Instance::Init(uint32_t argc, const char* argn[], const char* argv[]) {
+    for (uint32_t i = 0; i < argc; i++) {
+        std::string name(argn[i]);
+
+        if (name == "persist") persistence_name = argv[i];
+        if (name == "layers") settings.Layers(strtoul(argv[i], NULL, 10));
+        if (name == "color") settings.Color(true);
+
+        if (name == "headless") {
+            char* separator;
+            uint32_t width = strtoul(argv[i], &separator, 10),
+                     height = *separator == 'x' ?
+                        strtoul(separator + 1, NULL, 10) : 0;
+
+            if (width > 0 && height > 0) {
+                headless_extent = pp::Size(width, height);
+            } else {
+                logger->Log("Invalid headless size, ignoring.",
+                    Logger::LEVEL_WARNING);
+            }
+        }
+    }
+
+    return true;
 }
 
 /**
  * We use DidChangeView in order to create a graphics context and an instance
- * of our renderer class when the module becomes visible for the first time
+ * of our renderer class when the module becomes visible for the first time.
+ * In headless mode, the view is ignored and no graphics context is created.
  */
 void Instance::DidChangeView(const pp::View& view) {
     pp::Size extent = view.GetRect().size();
 
-    if (graphics == NULL) {
+    if (renderer == NULL && !headless_extent.IsEmpty()) {
+        renderer = new Renderer(this, *logger, *api, tracer, settings, NULL);
+        renderer->EnableHeadless(headless_extent);
+        if (!persistence_name.empty()) {
+            renderer->EnablePersistence(persistence_name);
+        }
+        renderer->Start();
+    }
+
+    if (renderer == NULL) {
         // In order to display anything we must create a graphics context and
         // bind it.
         graphics = new pp::Graphics2D(this, extent, true);
         BindGraphics(*graphics);
 
         // The renderer runs in a separate thread and houses the main loop.
-        renderer = new Renderer(this, *logger, *api, settings, graphics);
+        renderer = new Renderer(this, *logger, *api, tracer, settings, graphics);
+        if (!persistence_name.empty()) {
+            renderer->EnablePersistence(persistence_name);
+        }
         renderer->Start();
     }
 
@@ -68,37 +122,96 @@ void Instance::DidChangeView(const pp::View& view) {
 }
 
 /**
- * The renderer implements turtle-like graphics primitives, MoveTo and DrawTo.
- * In addition, a circle is drawn at the current curser position if the mouse
- * button is pressed.
+ * Mouse and touch events are translated into pointer events for the renderer.
+ * The renderer draws a line along the path of each pointer while it is down,
+ * and a circle at its current position.
  */
 bool Instance::HandleInputEvent(const pp::InputEvent& event) {
     if (renderer == NULL) return false;
 
+    PointerEvents events;
+    PointerEvent pointer_event;
+    pointer_event.id = mouse_pointer_id;
+
     switch (event.GetType()) {
         case PP_INPUTEVENT_TYPE_MOUSEDOWN:
             drawing = true;
-            renderer->SetDrawing(true);
-            renderer->MoveTo(pp::MouseInputEvent(event).GetPosition());
-            return true;
+            pointer_event.type = PointerEvent::POINTER_DOWN;
+            break;
 
         case PP_INPUTEVENT_TYPE_MOUSELEAVE:
         case PP_INPUTEVENT_TYPE_MOUSEUP:
             drawing = false;
-            renderer->SetDrawing(false);
-            return true;
+            pointer_event.type = PointerEvent::POINTER_UP;
+            break;
 
         case PP_INPUTEVENT_TYPE_MOUSEMOVE:
-            if (drawing) {
-                renderer->DrawTo(pp::MouseInputEvent(event).GetPosition());
-            }
+            if (!drawing) return true;
+            pointer_event.type = PointerEvent::POINTER_MOVE;
+            break;
+
+        case PP_INPUTEVENT_TYPE_TOUCHSTART:
+        case PP_INPUTEVENT_TYPE_TOUCHMOVE:
+        case PP_INPUTEVENT_TYPE_TOUCHEND:
+        case PP_INPUTEVENT_TYPE_TOUCHCANCEL:
+            TranslateTouchEvent(pp::TouchInputEvent(event), events);
+            if (!events.empty()) renderer->HandlePointerEvents(events);
             return true;
 
         default:
+            return false;
+    }
+
+    pp::Point position = pp::MouseInputEvent(event).GetPosition();
+    pointer_event.x = position.x();
+    pointer_event.y = position.y();
+    pointer_event.timestamp = event.GetTimeStamp();
+
+    events.push_back(pointer_event);
+    renderer->HandlePointerEvents(events);
+
+    return true;
+}
+
+/**
+ * A touch event carries all touch points which have changed, so a single
+ * event may generate several pointer events.
+ */
+void Instance::TranslateTouchEvent(
+    const pp::TouchInputEvent& event,
+    PointerEvents& events)
+{
+    PointerEvent::Type type;
+
+    switch (event.GetType()) {
+        case PP_INPUTEVENT_TYPE_TOUCHSTART:
+            type = PointerEvent::POINTER_DOWN;
+            break;
+
+        case PP_INPUTEVENT_TYPE_TOUCHMOVE:
+            type = PointerEvent::POINTER_MOVE;
+            break;
+
+        default:
+            type = PointerEvent::POINTER_UP;
             break;
     }
 
-    return false;
+    uint32_t count = event.GetTouchCount(PP_TOUCHLIST_TYPE_CHANGEDTOUCHES);
+    double timestamp = event.GetTimeStamp();
+
+    events.resize(count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        pp::TouchPoint point =
+            event.GetTouchByIndex(PP_TOUCHLIST_TYPE_CHANGEDTOUCHES, i);
+
+        events[i].type = type;
+        events[i].id = point.id();
+        events[i].x = point.position().x();
+        events[i].y = point.position().y();
+        events[i].timestamp = timestamp;
+    }
 }
 
 /**
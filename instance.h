@@ -25,14 +25,19 @@
 #ifndef GLOW_INSTANCE_H
 #define GLOW_INSTANCE_H
 
+#include <string>
+
 #include "ppapi/cpp/instance.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/input_event.h"
+#include "ppapi/cpp/size.h"
 
 #include "logger.h"
 #include "renderer.h"
 #include "settings.h"
 #include "api.h"
+#include "pointer.h"
+#include "trace.h"
 
 namespace glow {
 
@@ -52,6 +57,11 @@ class Instance : public pp::Instance {
          * to react on external events.
          */
 
+        /**
+         * Init is called with the attributes of the embed tag.
+         */
+        virtual bool Init(uint32_t argc, const char* argn[], const char* argv[]);
+
         /**
          * DidChangeView is called whenever the instance is shown, hidden,
          * resized, etc.
@@ -76,14 +86,34 @@ class Instance : public pp::Instance {
             return *logger;
         }
 
+        Tracer& GetTracer() {
+            return tracer;
+        }
+
+        /**
+         * The renderer is created once the instance becomes visible, so this
+         * may return NULL.
+         */
+        Renderer* GetRenderer() {
+            return renderer;
+        }
+
     private:
 
+        void TranslateTouchEvent(
+            const pp::TouchInputEvent& event,
+            PointerEvents& events
+        );
+
         pp::Graphics2D* graphics;
         Logger* logger;
         Renderer* renderer;
         bool drawing;
         Settings settings;
         Api* api;
+        Tracer tracer;
+        std::string persistence_name;
+        pp::Size headless_extent;
 };
 
 }
@@ -24,27 +24,181 @@
 
 #include "logger.h"
 
+#include <cstring>
+#include <cstdio>
+#include <sys/time.h>
+
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/core.h"
+
+namespace {
+
+const PP_LogLevel console_levels[] = {
+    PP_LOGLEVEL_TIP,
+    PP_LOGLEVEL_LOG,
+    PP_LOGLEVEL_WARNING,
+    PP_LOGLEVEL_ERROR
+};
+
+/**
+ * FNV-1a, used for assigning messages to rate limiting buckets.
+ */
+uint32_t Hash(const char* message) {
+    uint32_t hash = 2166136261u;
+
+    while (*message) {
+        hash ^= static_cast<uint8_t>(*message++);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+uint32_t Seconds() {
+    timeval current;
+    if (gettimeofday(&current, NULL) != 0) return 0;
+
+    return current.tv_sec;
+}
+
+}
 
 namespace glow {
 
-Logger::Logger(pp::Instance& instance) : instance(instance) {}
+Logger::Logger(pp::Instance& instance) :
+    instance(instance),
+    head(0),
+    tail(0),
+    dropped(0),
+    rate_limited(0)
+{
+    callback_factory = new pp::CompletionCallbackFactory<Logger>(this);
+
+    for (uint32_t i = 0; i < ring_size; i++) ring[i].sequence = i;
+
+    for (uint32_t i = 0; i < rate_buckets; i++) {
+        buckets[i].window = 0;
+        buckets[i].counter = 0;
+    }
 
-Logger::~Logger() {}
+    ScheduleDrain();
+}
+
+/**
+ * Write out whatever is left in the queue. Destroying the callback factory
+ * cancels the pending drain callback.
+ */
+Logger::~Logger() {
+    DrainQueue();
+    delete callback_factory;
+}
 
 /**
- * pp::Instance::LogToConsole logs a message on the javascript console. As the
- * docu doesn't say anything about thread safety, we use a mutex to be sure no
- * races can occur.
+ * Queue a message. This is a bounded multi-producer queue: each producer
+ * claims a record by advancing the tail with a compare-and-swap, writes the
+ * message and then publishes the record by bumping its sequence number. The
+ * GCC builtins imply full memory barriers.
  */
-void Logger::Log(const std::string& message) {
-    lock.Acquire();
+void Logger::Log(const char* message, Level level) {
+    if (!CheckRate(message)) {
+        __sync_fetch_and_add(&rate_limited, 1);
+        return;
+    }
+
+    uint32_t position = tail;
+    Record* record;
+
+    while (true) {
+        record = &ring[position % ring_size];
+        int32_t difference =
+            static_cast<int32_t>(record->sequence - position);
+
+        if (difference == 0) {
+            if (__sync_bool_compare_and_swap(&tail, position, position + 1)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // The ring is full.
+            __sync_fetch_and_add(&dropped, 1);
+            return;
+        }
+
+        position = tail;
+    }
+
+    record->level = level;
+    strncpy(record->message, message, message_size - 1);
+    record->message[message_size - 1] = '\0';
+
+    __sync_synchronize();
+    record->sequence = position + 1;
+}
+
+/**
+ * Allow at most rate_limit messages per bucket and second. Races between
+ * threads may let a few more messages through, which is fine.
+ */
+bool Logger::CheckRate(const char* message) {
+    RateBucket& bucket(buckets[Hash(message) % rate_buckets]);
+    uint32_t window = Seconds();
+
+    if (bucket.window != window) {
+        bucket.window = window;
+        bucket.counter = 0;
+    }
+
+    return __sync_add_and_fetch(&bucket.counter, 1) <= rate_limit;
+}
+
+void Logger::ScheduleDrain() {
+    pp::Module::Get()->core()->CallOnMainThread(drain_interval,
+        callback_factory->NewCallback(&Logger::Drain));
+}
+
+/**
+ * Periodic callback on the main thread.
+ */
+void Logger::Drain(uint32_t result) {
+    if (result != PP_OK) return;
+
+    DrainQueue();
+    ScheduleDrain();
+}
+
+/**
+ * pp::Instance::LogToConsole logs a message on the javascript console. This
+ * is the only consumer of the queue and runs on the main thread.
+ */
+void Logger::DrainQueue() {
+    while (true) {
+        Record& record(ring[head % ring_size]);
+
+        if (static_cast<int32_t>(record.sequence - (head + 1)) != 0) break;
+
+        // Don't be fooled by the fact that we directly pass a string, the
+        // compiled code converts this to a pp::Var by calling the proper
+        // constructor.
+        instance.LogToConsole(console_levels[record.level], record.message);
+
+        __sync_synchronize();
+        record.sequence = head + ring_size;
+        head++;
+    }
+
+    uint32_t dropped_messages = __sync_fetch_and_and(&dropped, 0),
+             limited_messages = __sync_fetch_and_and(&rate_limited, 0);
+
+    if (dropped_messages > 0 || limited_messages > 0) {
+        char message[message_size];
 
-    // Don't be fooled by the fact that we directly pass a string, the compiled
-    // code converts this to a pp::Var by calling the proper constructor.
-    instance.LogToConsole(PP_LOGLEVEL_LOG, message);
+        snprintf(message, message_size,
+            "Logger: dropped %u messages (queue full), %u (rate limit)",
+            static_cast<unsigned>(dropped_messages),
+            static_cast<unsigned>(limited_messages));
 
-    lock.Release();
+        instance.LogToConsole(PP_LOGLEVEL_WARNING, message);
+    }
 }
 
 }
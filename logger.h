@@ -26,30 +26,90 @@
 #define GLOW_LOGGER_H
 
 #include <string>
+#include <stdint.h>
 
 #include "ppapi/cpp/instance.h"
-#include "ppapi/utility/threading/lock.h"
+#include "ppapi/utility/completion_callback_factory.h"
 
 namespace glow {
 
 /**
  * The Logger class wraps provides logging without directly calling the
- * instance methods.
+ * instance methods. Messages are queued in a lock-free ring buffer with
+ * preallocated records and written to the console from the main thread, so
+ * logging never blocks the calling thread. If the ring is full or a message
+ * is repeated too often, it is dropped and accounted for instead.
  */
 class Logger {
     public:
 
+        enum Level {
+            LEVEL_TIP,
+            LEVEL_LOG,
+            LEVEL_WARNING,
+            LEVEL_ERROR
+        };
+
+        /**
+         * The logger must be created on the main thread.
+         */
         Logger(pp::Instance& instance);
         ~Logger();
 
-        void Log(const std::string& message);
+        void Log(const char* message, Level level = LEVEL_LOG);
+        void Log(const std::string& message, Level level = LEVEL_LOG) {
+            Log(message.c_str(), level);
+        }
 
     private:
 
+        static const uint32_t ring_size = 256;
+        static const uint32_t message_size = 120;
+
+        /**
+         * A message is limited to this many occurences per second.
+         */
+        static const uint32_t rate_limit = 10;
+        static const uint32_t rate_buckets = 64;
+
+        /**
+         * Interval in milliseconds at which the queue is drained.
+         */
+        static const int32_t drain_interval = 100;
+
+        /**
+         * The sequence number of each record tells producers and the consumer
+         * whether the record is free or holds a message.
+         */
+        struct Record {
+            volatile uint32_t sequence;
+            uint8_t level;
+            char message[message_size];
+        };
+
+        /**
+         * Messages are rate limited per hash bucket, so colliding messages
+         * share a budget.
+         */
+        struct RateBucket {
+            volatile uint32_t window;
+            volatile uint32_t counter;
+        };
+
         pp::Instance& instance;
 
-        // pp::Lock is a simple wrapper around a POSIX mutex.
-        pp::Lock lock;
+        Record ring[ring_size];
+        volatile uint32_t head, tail;
+        volatile uint32_t dropped, rate_limited;
+
+        RateBucket buckets[rate_buckets];
+
+        pp::CompletionCallbackFactory<Logger>* callback_factory;
+
+        bool CheckRate(const char* message);
+        void ScheduleDrain();
+        void Drain(uint32_t result);
+        void DrainQueue();
 
         Logger(const Logger&);
         const Logger& operator=(const Logger&);
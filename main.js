@@ -29,18 +29,27 @@
          * by ID
          */
         inputs = {
+            layer: 'layer',
             bleed: 'bleed',
             radius: 'radius',
+            brushHardness: 'brush_hardness',
+            brushIntensity: 'brush_intensity',
+            brushColor: 'brush_color',
             decayExp: 'decay_exp',
             decayLin: 'decay_lin',
             fps: 'target_fps'
         },
         /**
-         * Dito, this houses the FPS displays.
+         * Dito, this houses the FPS, latency and quality displays.
          */
         fpsDisplays = {
             processingFps: 'fps_processing',
-            renderingFps: 'fps_rendering'
+            renderingFps: 'fps_rendering',
+            latency: 'latency',
+            displayLatency: 'display_latency',
+            jitter: 'jitter',
+            maxJitter: 'max_jitter',
+            qualityLevel: 'quality_level'
         };
 
     /**
@@ -49,10 +58,18 @@
      */
     function marshall(name, value) {
         switch (name) {
+            case 'layer':
+                return parseInt(value, 10);
             case 'bleed':
                 return parseFloat(value);
             case 'radius':
                 return parseInt(value, 10);
+            case 'brushHardness':
+                return parseFloat(value);
+            case 'brushIntensity':
+                return parseInt(value, 10);
+            case 'brushColor':
+                return parseInt(value.substr(1), 16);
             case 'decayExp':
                 return parseFloat(value);
             case 'decayLin':
@@ -64,6 +81,18 @@
         }
     }
 
+    /**
+     * Convert a value received from the module for display in its input.
+     */
+    function unmarshall(name, value) {
+        switch (name) {
+            case 'brushColor':
+                return '#' + (0x1000000 + value).toString(16).substr(1);
+            default:
+                return value;
+        }
+    }
+
     /**
      * Handle an incoming message and delegate to an event handler.
      */
@@ -72,8 +101,8 @@
 
         if (subject == 'settingsBroadcast') {
             onSettingsBroadcast(message.data);
-        } else if (subject == 'fpsBroadcast') {
-            onFpsBroadcast(message.data);
+        } else if (subject == 'telemetry') {
+            onTelemetry(message.data);
         } else if (subject == 'error') {
             console.log('module reports error: ', message.data);
         } else {
@@ -82,13 +111,16 @@
     }
     
     /**
-     * Update FPS display.
+     * Update FPS display. Telemetry messages only carry the values which have
+     * changed since the last message. Zero is a valid value for most gauges,
+     * so only missing keys are skipped.
      */
-    function onFpsBroadcast(message) {
+    function onTelemetry(message) {
         for (name in fpsDisplays) {
-            if (message[name]) {
+            if (message[name] !== undefined) {
                 getFpsMonitor(fpsDisplays[name]).innerHTML =
-                    message[name].toFixed(3);
+                    name == 'qualityLevel' ?
+                        message[name] : message[name].toFixed(3);
             }
         }
     }
@@ -97,12 +129,17 @@
      * Update sliders with updates settings.
      */
     function onSettingsBroadcast(message) {
+        // The layer slider covers the layers the module has been started with.
+        if (message.hasOwnProperty('layers')) {
+            getInput(inputs.layer).max = message.layers - 1;
+        }
+
         for (var name in inputs) (function(name) {
             var container = inputs[name],
                 input = getInput(container);
 
             if (message.hasOwnProperty(name)) {
-                input.value = message[name];
+                input.value = unmarshall(name, message[name]);
                 onInputChange(name);
             }
         })(name);
@@ -120,11 +157,29 @@
             monitor = getMonitor(container);
 
         monitor.innerHTML = input.value;
-        if (relay) {
+
+        // Bleed and decay are per layer, so switching the layer must not
+        // relay the other sliders. Instead, we fetch the settings of the new
+        // layer.
+        if (relay && name == 'layer') {
+            selectLayer(marshall(name, input.value));
+        } else if (relay) {
             relaySettings();
         }
     }
 
+    function selectLayer(layer) {
+        if (module) {
+            module.postMessage({
+                subject: 'changeSettings',
+                layer: layer
+            });
+            module.postMessage({
+                subject: 'requestSettings'
+            });
+        }
+    }
+
     /**
      * Build a settings update message and post it to the module
      */
@@ -0,0 +1,72 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_MODULE_H
+#define GLOW_MODULE_H
+
+#include "ppapi/cpp/module.h"
+
+#include "scheduler.h"
+
+namespace glow {
+
+/**
+ * Every NaCl program must define a module class which derives from pp::Module
+ * and implements the CreateInstance factory method. The module also houses
+ * the scheduler shared by all instances on the page.
+ */
+class Module : public pp::Module {
+    public:
+
+        Module() {}
+
+        /**
+         * The actual program logic goes into an Instance class which extends
+         * pp::Instance. This method has to be implemented and works as a factory
+         * for new Instance instances.
+         */
+        virtual pp::Instance* CreateInstance(PP_Instance instance);
+
+        Scheduler& GetScheduler() {
+            return scheduler;
+        }
+
+        /**
+         * The module of this program, see pp::Module::Get.
+         */
+        static Module* Get() {
+            return static_cast<Module*>(pp::Module::Get());
+        }
+
+    private:
+
+        Scheduler scheduler;
+
+        Module(const Module&);
+        const Module& operator=(const Module&);
+};
+
+}
+
+#endif // GLOW_MODULE_H
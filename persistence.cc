@@ -0,0 +1,302 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "persistence.h"
+
+#include <cstring>
+
+#include "ppapi/c/pp_errors.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/file_ref.h"
+
+namespace glow {
+
+Persistence::Persistence(
+    const pp::InstanceHandle& handle,
+    Logger& logger,
+    const std::string& name)
+:
+    handle(handle),
+    logger(logger),
+    path("/" + name),
+    file(NULL),
+    width(0),
+    height(0),
+    layers(0),
+    strips(0),
+    row_size(0),
+    planes(0),
+    queue_position(0),
+    write_offset(0)
+{
+    callback_factory = new pp::CompletionCallbackFactory<Persistence>(this);
+}
+
+/**
+ * Destroying the factory aborts any write callbacks which are still pending.
+ */
+Persistence::~Persistence() {
+    delete callback_factory;
+
+    if (file != NULL) {
+        file->Close();
+        delete file;
+    }
+}
+
+/**
+ * Passing pp::BlockUntilComplete instead of a callback makes the pepper calls
+ * synchronous. This is only allowed off the main thread.
+ */
+bool Persistence::Open(Surface& surface, bool restore) {
+    width = surface.GetWidth();
+    height = surface.GetHeight();
+    layers = surface.GetLayers() | (surface.IsInterleaved() ? color_flag : 0);
+    row_size = surface.GetRowSize();
+    planes = surface.GetPlanes();
+    strips = (height + strip_height - 1) / strip_height;
+
+    uint32_t area = row_size * height,
+             size = planes * area;
+
+    file_system = pp::FileSystem(handle, PP_FILESYSTEMTYPE_LOCALPERSISTENT);
+    if (file_system.Open(sizeof(Header) + size, pp::BlockUntilComplete()) != PP_OK) {
+        logger.Log("Persistence: unable to open the file system.",
+            Logger::LEVEL_WARNING);
+        return false;
+    }
+
+    pp::FileRef file_ref(file_system, path.c_str());
+    file = new pp::FileIO(handle);
+
+    if (file->Open(file_ref,
+            PP_FILEOPENFLAG_READ | PP_FILEOPENFLAG_WRITE | PP_FILEOPENFLAG_CREATE,
+            pp::BlockUntilComplete()) != PP_OK)
+    {
+        logger.Log("Persistence: unable to open " + path,
+            Logger::LEVEL_WARNING);
+        return false;
+    }
+
+    shadow.assign(size, 0);
+    unwritten.assign(planes * strips, false);
+
+    Header header;
+    bool valid =
+        ReadBlocking(0, reinterpret_cast<uint8_t*>(&header), sizeof(header)) &&
+        header.magic == magic && header.width == width && header.height == height &&
+        (header.layers == layers || (header.layers == 0 && layers == 1));
+
+    // If the header matches, the rows are read straight into the surface.
+    // The shadow is left blank instead of holding a second copy, so all
+    // strips are written once on the next sync. Without restoring, the
+    // surface is newer than the file anyway.
+    if (valid && (!restore || ReadSurface(surface))) {
+        unwritten.assign(planes * strips, true);
+        if (restore) logger.Log("Persistence: restored surface from " + path);
+
+        return true;
+    }
+
+    // Don't keep a partial restore.
+    if (valid) surface.Clear();
+
+    // Otherwise we start over with a blank file. SetLength fills it with
+    // zeros, which matches the blank shadow.
+    header.magic = magic;
+    header.width = width;
+    header.height = height;
+    header.layers = layers;
+
+    if (file->SetLength(0, pp::BlockUntilComplete()) != PP_OK ||
+        file->SetLength(sizeof(header) + size, pp::BlockUntilComplete()) != PP_OK ||
+        !WriteBlocking(0, reinterpret_cast<uint8_t*>(&header), sizeof(header)))
+    {
+        logger.Log("Persistence: unable to initialize " + path,
+            Logger::LEVEL_WARNING);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * The rows of the surface are padded, so they are read one by one.
+ */
+bool Persistence::ReadSurface(Surface& surface) {
+    uint32_t stride = surface.GetStride(),
+             area = row_size * height;
+
+    for (uint32_t i = 0; i < planes; i++) {
+        uint8_t* buffer = surface.GetBuffer(i);
+
+        for (uint32_t y = 0; y < height; y++) {
+            if (!ReadBlocking(sizeof(Header) + i * area + y * row_size,
+                    buffer + y * stride, row_size))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Reads and writes may transfer less than requested, so we loop.
+ */
+bool Persistence::ReadBlocking(int64_t offset, uint8_t* buffer, uint32_t length) {
+    while (length > 0) {
+        int32_t result = file->Read(offset, reinterpret_cast<char*>(buffer),
+            length, pp::BlockUntilComplete());
+
+        if (result <= 0) return false;
+
+        offset += result;
+        buffer += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+bool Persistence::WriteBlocking(
+    int64_t offset,
+    const uint8_t* buffer,
+    uint32_t length)
+{
+    while (length > 0) {
+        int32_t result = file->Write(offset, reinterpret_cast<const char*>(buffer),
+            length, pp::BlockUntilComplete());
+
+        if (result <= 0) return false;
+
+        offset += result;
+        buffer += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+void Persistence::Sync(Surface& surface) {
+    if (file == NULL || queue_position < queue.size()) return;
+
+    queue.clear();
+    queue_position = 0;
+    write_offset = 0;
+
+    uint32_t stride = surface.GetStride();
+
+    for (uint32_t i = 0; i < planes; i++) {
+        const uint8_t* buffer = surface.GetBuffer(i);
+        uint8_t* plane_shadow = &shadow[i * row_size * height];
+
+        for (uint32_t y = 0; y < height; y += strip_height) {
+            uint32_t end = y + strip_height > height ? height : y + strip_height,
+                     index = i * strips + y / strip_height;
+            bool dirty = unwritten[index];
+
+            for (uint32_t row = y; row < end; row++) {
+                const uint8_t* source = buffer + row * stride;
+                uint8_t* target = plane_shadow + row * row_size;
+
+                if (dirty || memcmp(source, target, row_size) != 0) {
+                    memcpy(target, source, row_size);
+                    dirty = true;
+                }
+            }
+
+            if (dirty) {
+                queue.push_back(index);
+                unwritten[index] = false;
+            }
+        }
+    }
+
+    WriteNext();
+}
+
+/**
+ * The location of a strip within the shadow (and the file, after the header).
+ */
+void Persistence::GetStrip(
+    uint32_t index,
+    uint32_t& offset,
+    uint32_t& length) const
+{
+    uint32_t y = (index % strips) * strip_height;
+
+    offset = (index / strips) * row_size * height + y * row_size;
+    length = (y + strip_height > height ? height - y : strip_height) * row_size;
+}
+
+/**
+ * Issue the write for the current strip, continuing at write_offset if the
+ * previous write was short.
+ */
+void Persistence::WriteNext() {
+    if (queue_position >= queue.size()) return;
+
+    uint32_t offset, length;
+    GetStrip(queue[queue_position], offset, length);
+
+    int32_t result = file->Write(
+        sizeof(Header) + offset + write_offset,
+        reinterpret_cast<const char*>(&shadow[offset + write_offset]),
+        length - write_offset,
+        callback_factory->NewCallback(&Persistence::WriteCallback)
+    );
+
+    if (result != PP_OK_COMPLETIONPENDING) WriteCallback(result);
+}
+
+void Persistence::WriteCallback(int32_t result) {
+    if (result <= 0) {
+        // Give up on this round. The shadow already holds the new contents
+        // of the remaining strips, so they are flagged for the next sync.
+        logger.Log("Persistence: write failed.", Logger::LEVEL_WARNING);
+
+        for (; queue_position < queue.size(); queue_position++) {
+            unwritten[queue[queue_position]] = true;
+        }
+        write_offset = 0;
+
+        return;
+    }
+
+    uint32_t offset, length;
+    GetStrip(queue[queue_position], offset, length);
+
+    write_offset += result;
+
+    if (write_offset >= length) {
+        write_offset = 0;
+        queue_position++;
+    }
+
+    WriteNext();
+}
+
+}
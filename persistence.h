@@ -0,0 +1,146 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_PERSISTENCE_H
+#define GLOW_PERSISTENCE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/cpp/file_system.h"
+#include "ppapi/cpp/file_io.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+#include "logger.h"
+#include "surface.h"
+
+namespace glow {
+
+/**
+ * The Persistence class keeps a copy of the surface in a file on the pepper
+ * persistent file system, so the glow survives module reloads. The file holds
+ * a small header followed by the raw rows of each plane without padding. The
+ * planes are divided into horizontal strips, and only strips which have
+ * changed since the last sync are written.
+ *
+ * All methods must be called on the rendering thread. Open blocks, while
+ * Sync only queues asynchronous writes which are completed while the
+ * rendering loop pumps its message loop.
+ */
+class Persistence {
+    public:
+
+        Persistence(
+            const pp::InstanceHandle& handle,
+            Logger& logger,
+            const std::string& name
+        );
+        ~Persistence();
+
+        /**
+         * Open the file and, if restore is set, restore its contents into
+         * the surface if the dimensions match. Otherwise the surface is
+         * newer than the file and is written on the next sync. Returns false
+         * if the file cannot be used.
+         */
+        bool Open(Surface& surface, bool restore = true);
+
+        /**
+         * Start writing all strips which have changed or are flagged as
+         * unwritten. Does nothing if the previous sync is still in progress.
+         */
+        void Sync(Surface& surface);
+
+    private:
+
+        /**
+         * The number of layers is or'ed with color_flag for an interleaved
+         * RGB surface.
+         */
+        struct Header {
+            uint32_t magic;
+            uint32_t width, height;
+            uint32_t layers;
+        };
+
+        static const uint32_t magic = 0x574f4c47;
+        static const uint32_t color_flag = 0x100;
+        static const uint32_t strip_height = 32;
+
+        pp::InstanceHandle handle;
+        Logger& logger;
+        std::string path;
+
+        pp::FileSystem file_system;
+        pp::FileIO* file;
+
+        uint32_t width, height, layers, strips;
+
+        /**
+         * The size of a row of a plane in bytes and the number of planes.
+         */
+        uint32_t row_size, planes;
+
+        /**
+         * The shadow holds the surface as last written. Changed strips are
+         * copied here and written from here, so the surface can be modified
+         * while the writes are in flight.
+         */
+        std::vector<uint8_t> shadow;
+
+        /**
+         * Strips which are written on the next sync even if the shadow
+         * matches the surface: the file content is unknown after a restore,
+         * and stale after a failed write.
+         */
+        std::vector<bool> unwritten;
+
+        /**
+         * FileIO only allows one write at a time, so the writes are chained.
+         * The queue holds the indices of the dirty strips, counted across
+         * all planes.
+         */
+        std::vector<uint32_t> queue;
+        uint32_t queue_position;
+        uint32_t write_offset;
+
+        pp::CompletionCallbackFactory<Persistence>* callback_factory;
+
+        bool ReadBlocking(int64_t offset, uint8_t* buffer, uint32_t length);
+        bool WriteBlocking(int64_t offset, const uint8_t* buffer, uint32_t length);
+        bool ReadSurface(Surface& surface);
+
+        void GetStrip(uint32_t index, uint32_t& offset, uint32_t& length) const;
+        void WriteNext();
+        void WriteCallback(int32_t result);
+
+        Persistence(const Persistence&);
+        const Persistence& operator=(const Persistence&);
+};
+
+}
+
+#endif // GLOW_PERSISTENCE_H
@@ -0,0 +1,62 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_POINTER_H
+#define GLOW_POINTER_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace glow {
+
+/**
+ * Mouse and touch input are both translated into pointer events. Each touch
+ * point is identified by the id assigned by the browser, while the mouse uses
+ * a reserved id.
+ */
+struct PointerEvent {
+    enum Type {
+        POINTER_DOWN,
+        POINTER_MOVE,
+        POINTER_UP
+    };
+
+    Type type;
+    uint32_t id;
+    float x, y;
+
+    /**
+     * The time at which the browser received the event, in seconds on the
+     * pp::Core::GetTimeTicks clock.
+     */
+    double timestamp;
+};
+
+typedef std::vector<PointerEvent> PointerEvents;
+
+const uint32_t mouse_pointer_id = 0xFFFFFFFF;
+
+}
+
+#endif // GLOW_POINTER_H
@@ -24,13 +24,20 @@
 
 #include "renderer.h"
 
-#include <unistd.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/image_data.h"
 #include "ppapi/cpp/point.h"
 #include "ppapi/cpp/size.h"
 #include "ppapi/cpp/message_loop.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/core.h"
+
+#include "rle.h"
+#include "module.h"
 
 namespace {
 
@@ -39,30 +46,32 @@ int32_t TimeDifference(const timeval& t1, const timeval& t2) {
 }
 
 /**
- * Sleep until a certain delay w.r.t. a reference timestamp has passed. Note
- * the use of the POSIX calls gettimeofday and usleep.
+ * The current time in microseconds. This is used for timestamping frames in
+ * order to measure latency.
  */
-uint32_t delay(const timeval& reference, uint32_t delay)
-{
+int64_t Timestamp() {
     timeval current;
     if (gettimeofday(&current, NULL) != 0) return 0;
 
-    int32_t actual_delay = delay - TimeDifference(reference, current);
-
-    if (actual_delay > static_cast<int32_t>(delay)) {
-        actual_delay = delay;
-    }
-
-    if (actual_delay > 0) {
-        usleep(actual_delay);
-    }
-    return actual_delay;
+    return static_cast<int64_t>(current.tv_sec) * 1000000 + current.tv_usec;
 }
 
 inline uint32_t PixelRGB(const uint8_t r, const uint8_t g, const uint8_t b) {
     return 0xFF000000 | (b << 16) | (g << 8) | r;
 }
 
+/**
+ * Add two pixels, saturating each channel separately. The channels are added
+ * without carries between them, and the carries out of each channel are then
+ * spread into a mask.
+ */
+inline uint32_t PixelAdd(const uint32_t a, const uint32_t b) {
+    uint32_t sum = ((a & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((a ^ b) & 0x80808080),
+             carry = ((a & b) | ((a | b) & ~sum)) & 0x80808080;
+
+    return sum | ((carry >> 7) * 0xFF);
+}
+
 }
 
 namespace glow {
@@ -71,229 +80,813 @@ Renderer::Renderer(
     const pp::InstanceHandle& handle,
     Logger& logger,
     Api& api,
+    Tracer& tracer,
     const volatile Settings& settings,
     pp::Graphics2D* graphics)
 :
    handle(handle),
    logger(logger),
    api(api),
+   tracer(tracer),
    graphics(graphics),
-   thread(NULL),
-   quit_requested(false),
+   worker(NULL),
    surface(NULL),
-   drawing(false),
+   frames(NULL),
+   frame_stride(0),
+   frame_layers(1),
+   frame_planes(1),
+   frame_color(false),
+   persistence(NULL),
+   persistence_restored(false),
+   quality_level(0),
+   quality_headroom(0),
+   frame_counter(0),
+   simulating(false),
+   due(0),
+   processing_counter(0),
+   processing_time(0),
+   jitter_sum(0),
+   jitter_max(0),
+   jitter_counter(0),
+   derived(false),
+   derived_version(0),
+   derived_quality(0),
+   input_timestamp(0),
+   image_ring_index(0),
+   render_pending(false),
+   frame_staged(false),
+   palette_dirty(0),
+   render_counter(0),
+   latency_sum(0),
+   latency_counter(0),
+   display_latency_sum(0),
+   display_latency_counter(0),
    settings(settings)
 {
+    for (uint32_t i = 0; i < image_ring_size; i++) image_ring[i] = NULL;
+    for (uint32_t i = 0; i < max_pointers; i++) pointers[i].active = false;
+
+    // Reserve enough room for the segments queued during a frame, so we
+    // don't have to allocate on the rendering thread in the common case.
+    segments.reserve(256);
+
+    // The default palette of the first layer is plain grayscale, the other
+    // layers are tinted so they can be told apart. Palettes are not used in
+    // color mode.
+    for (uint32_t i = 0; i < 256; i++) {
+        palette[0][i] = PixelRGB(i, i, i);
+        palette[1][i] = PixelRGB(i, i / 2, i / 8);
+        palette[2][i] = PixelRGB(i / 8, i / 2, i);
+        palette[3][i] = PixelRGB(i / 4, i, i / 4);
+    }
+
     // Create the callback factory. According to the API docs, creating and
     // destroying the callback factory is not threadsafe, while genrating
     // callbacks is (unless differently specified via trait), and creation
     // and destruction should happen from the same thread that executes the
-    // callbacks in order to avoid races. However, the thread will not be
-    // dispatched before this function has finished, so we are safe.
+    // callbacks in order to avoid races. However, the renderer will not be
+    // attached to a worker before this function has finished, so we are
+    // safe.
     callback_factory = new pp::CompletionCallbackFactory<Renderer>(this);
 }
 
 Renderer::~Renderer() {
     Stop();
 
-    // See above. Stop() waits until the message loop has been closed and
-    // the thread has terminated, so there is no danger of races.
+    // See above. Stop() waits until the worker has processed everything we
+    // have posted and let go of us, so there is no danger of races.
     delete callback_factory;
 }
 
-void Renderer::DispatchThreadCallback(pp::MessageLoop&, void* user_data) {
-    // Dispatch the main loop.
-    static_cast<glow::Renderer*>(user_data)->Dispatch();
-}
-
 void Renderer::Start() {
-    if (thread != NULL) {
+    if (worker != NULL) {
         return;
     }
 
-    // Create a new thread and dispatch it.
-    logger.Log("Starting rendering thread...");
+    // The surface and the buffers shared between the two stages are allocated
+    // before attaching to a worker. Frames are published with the
+    // padding of the surface rows, so they can be copied in one go.
+    pp::Size extent = graphics != NULL ? graphics->size() : headless_extent;
+    frame_layers = settings.Layers();
+    frame_color = settings.Color();
+    surface = new Surface(
+        extent.width(), extent.height(), frame_layers, frame_color);
+    frame_planes = surface->GetPlanes();
+    frame_stride = surface->GetStride();
+    frames = new TripleBuffer(frame_planes * frame_stride * extent.height());
+    persistence_restored = false;
+    if (graphics != NULL) AllocateImageRing();
+
+    // The decay plans belong to the surface.
+    derived = false;
 
-    thread = new pp::SimpleThread(handle);
-    quit_requested = false;
-    thread->StartWithFunction(&DispatchThreadCallback, this);
+    logger.Log("Attaching to the scheduler...");
+
+    Module::Get()->GetScheduler().Attach(this, handle, extent.GetArea());
+}
+
+void Renderer::EnablePersistence(const std::string& name) {
+    if (worker == NULL) persistence_name = name;
+}
+
+void Renderer::EnableHeadless(const pp::Size& extent) {
+    if (worker == NULL && graphics == NULL) headless_extent = extent;
 }
 
 void Renderer::Stop() {
-    if (thread == NULL) {
+    if (worker == NULL) {
         return;
     }
 
-    // SimpleThread::Join posts a quit message to the message loop, closes it
-    // and waits for the threads to join. After closing the loop,
-    // pp::MessageLoop::Run will crash, so we have to make sure that the
-    // rendering loop stops pumping the message loop before joining.
-    logger.Log("Waiting for rendering loop to quit...");
+    // Once detached, neither of the worker threads touches the renderer
+    // anymore, so we can safely release the buffers.
+    logger.Log("Detaching from the scheduler...");
 
-    message_loop_lock.Acquire();
-    quit_requested = true;
-    message_loop_lock.Release();
+    Module::Get()->GetScheduler().Detach(this);
 
-    thread->Join();
-    delete thread;
-    thread = NULL;
+    ReleaseImageRing();
+    delete frames;
+    frames = NULL;
+    delete surface;
+    surface = NULL;
 
     logger.Log("Renderer successfully stopped.");
 }
 
 /**
- * As the three render API calls are called from the main thread, they do not
- * actually do any work, but post callbacks to the message loop instead. The
- * main loop polls and runs the message loop, causing the requested actions
- * to be eventually executed, while the API call returns immediatelly after
- * queuing the message.
+ * As the render API calls are called from the main thread, they do not
+ * actually do any work, but post callbacks to the message loop of the
+ * simulation thread instead. The worker runs them in between two steps,
+ * while the API call returns immediatelly after queuing the message.
  */
-void Renderer::MoveTo(const pp::Point& x) {
+void Renderer::HandlePointerEvents(const PointerEvents& events) {
     // Generate a callback from the factory. Note how the factory binds the
-    // value of x.
-    if (thread) thread->message_loop().PostWork(callback_factory->NewCallback(
-        &Renderer::DoMoveTo, x)
+    // events. The timestamp is taken here in order to include the queueing
+    // delay into the latency measurement.
+    tracer.Instant(Tracer::PHASE_INPUT);
+
+    if (worker) worker->GetMessageLoop().PostWork(callback_factory->NewCallback(
+        &Renderer::DoHandlePointerEvents, events, Timestamp())
     );
 }
 
 /**
- * See above.
+ * See above. The whole stroke is bound to a single callback.
+ */
+void Renderer::DrawStroke(const Stroke& stroke) {
+    if (worker) worker->GetMessageLoop().PostWork(callback_factory->NewCallback(
+        &Renderer::DoDrawStroke, stroke, Timestamp())
+    );
+}
+
+/**
+ * The snapshot is taken on the rendering thread and sent to JS via the API.
  */
-void Renderer::DrawTo(const pp::Point& x) {
-    if (thread) thread->message_loop().PostWork(callback_factory->NewCallback(
-        &Renderer::DoDrawTo, x)
+void Renderer::RequestSnapshot() {
+    if (worker) worker->GetMessageLoop().PostWork(callback_factory->NewCallback(
+        &Renderer::DoRequestSnapshot)
     );
 }
 
 /**
  * See above.
  */
-void Renderer::SetDrawing(bool isDrawing) {
-    if (thread)thread->message_loop().PostWork(callback_factory->NewCallback(
-        &Renderer::DoSetDrawing, isDrawing)
+void Renderer::RestoreSnapshot(
+    uint32_t width,
+    uint32_t height,
+    const std::vector<uint8_t>& encoded)
+{
+    if (worker) worker->GetMessageLoop().PostWork(callback_factory->NewCallback(
+        &Renderer::DoRestoreSnapshot, width, height, encoded)
     );
 }
 
 /**
- * The three worker callbacks are dispatched on the rendering thread and do
- * the actual work.
+ * The palettes are used during conversion on the presentation thread, so we
+ * only stage the new one here.
  */
-void Renderer::DoMoveTo(uint32_t status, const pp::Point& x) {
-    if (status == PP_OK) current_position = x;
+void Renderer::SetPalette(uint32_t layer, const std::vector<uint32_t>& palette) {
+    if (layer < Settings::max_layers && palette.size() == 256) {
+        pp::AutoLock lock(palette_lock);
+
+        memcpy(staged_palette[layer], &palette[0], sizeof(staged_palette[layer]));
+        palette_dirty |= 1 << layer;
+    }
 }
 
-void Renderer::DoDrawTo(uint32_t status, const pp::Point& x) {
-    if (status == PP_OK && surface != NULL) surface->Line(
-        current_position.x(), current_position.y(),
-        x.x(), x.y(), settings.Radius()
+Renderer::Pointer* Renderer::FindPointer(uint32_t id) {
+    for (uint32_t i = 0; i < max_pointers; i++) {
+        if (pointers[i].active && pointers[i].id == id) return &pointers[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * The posted callbacks are dispatched on the simulation thread and do the
+ * actual work.
+ *
+ * Update the pointer table. Pointers which don't fit into the table are
+ * ignored.
+ */
+void Renderer::DoHandlePointerEvents(
+    uint32_t status,
+    const PointerEvents& events,
+    int64_t timestamp)
+{
+    if (status != PP_OK) return;
+
+    Tracer::Scope scope(tracer, Tracer::PHASE_PUMP);
+
+    for (uint32_t i = 0; i < events.size(); i++) {
+        const PointerEvent& event(events[i]);
+        Pointer* pointer = FindPointer(event.id);
+
+        switch (event.type) {
+            case PointerEvent::POINTER_DOWN:
+                for (uint32_t j = 0; pointer == NULL && j < max_pointers; j++) {
+                    if (!pointers[j].active) pointer = &pointers[j];
+                }
+
+                if (pointer != NULL) {
+                    pointer->active = true;
+                    pointer->id = event.id;
+
+                    for (uint32_t j = 0; j < 3; j++) {
+                        pointer->x[j] = event.x;
+                        pointer->y[j] = event.y;
+                        pointer->timestamp[j] = event.timestamp;
+                    }
+                }
+                break;
+
+            case PointerEvent::POINTER_MOVE:
+                if (pointer != NULL) {
+                    QueueCurve(*pointer, event.x, event.y, event.timestamp);
+                }
+                break;
+
+            case PointerEvent::POINTER_UP:
+                // Finish the curve by repeating the last sample.
+                if (pointer != NULL) {
+                    QueueCurve(*pointer,
+                        pointer->x[2], pointer->y[2], event.timestamp);
+                    pointer->active = false;
+                }
+                break;
+        }
+    }
+
+    if (input_timestamp == 0) input_timestamp = timestamp;
+}
+
+/**
+ * Add a sample to the pointer path and queue the curve between the two
+ * previous samples. The curve is subdivided into straight segments depending
+ * on how far the Bezier control points of the spline deviate from the chord,
+ * so straight strokes cost a single segment while tight turns get finer.
+ */
+void Renderer::QueueCurve(
+    Pointer& pointer,
+    float x, float y,
+    double timestamp)
+{
+    float x0 = pointer.x[0], y0 = pointer.y[0],
+          x1 = pointer.x[1], y1 = pointer.y[1],
+          x2 = pointer.x[2], y2 = pointer.y[2];
+    double timestamp1 = pointer.timestamp[1],
+           timestamp2 = pointer.timestamp[2];
+
+    pointer.x[0] = x1; pointer.y[0] = y1;
+    pointer.x[1] = x2; pointer.y[1] = y2;
+    pointer.x[2] = x;  pointer.y[2] = y;
+
+    pointer.timestamp[0] = timestamp1;
+    pointer.timestamp[1] = timestamp2;
+    pointer.timestamp[2] = timestamp;
+
+    float chord_x = x2 - x1,
+          chord_y = y2 - y1,
+          chord = sqrtf(chord_x * chord_x + chord_y * chord_y);
+
+    if (chord == 0) return;
+
+    // The Catmull-Rom segment from p1 to p2 is the Bezier curve with control
+    // points p1 + (p2 - p0) / 6 and p2 - (p3 - p1) / 6.
+    float tangent1_x = (x2 - x0) / 6, tangent1_y = (y2 - y0) / 6,
+          tangent2_x = (x - x1) / 6, tangent2_y = (y - y1) / 6;
+
+    float deviation1 = fabsf(tangent1_x * chord_y - tangent1_y * chord_x) / chord,
+          deviation2 = fabsf(tangent2_x * chord_y - tangent2_y * chord_x) / chord,
+          deviation = deviation1 > deviation2 ? deviation1 : deviation2;
+
+    // The error of a subdivided curve drops quadratically with the number of
+    // pieces. This keeps it below roughly a quarter pixel.
+    uint32_t pieces = static_cast<uint32_t>(ceilf(sqrtf(deviation * 3)));
+    if (pieces < 1) pieces = 1;
+    if (pieces > 16) pieces = 16;
+
+    Segment segment;
+    segment.x1 = x1;
+    segment.y1 = y1;
+
+    for (uint32_t i = 1; i <= pieces; i++) {
+        float t = static_cast<float>(i) / pieces,
+              t2 = t * t,
+              t3 = t2 * t;
+
+        // Hermite basis with Catmull-Rom tangents
+        float h1 = 2 * t3 - 3 * t2 + 1,
+              h2 = -2 * t3 + 3 * t2,
+              h3 = t3 - 2 * t2 + t,
+              h4 = t3 - t2;
+
+        segment.x2 = h1 * x1 + h2 * x2 + 3 * (h3 * tangent1_x + h4 * tangent2_x);
+        segment.y2 = h1 * y1 + h2 * y2 + 3 * (h3 * tangent1_y + h4 * tangent2_y);
+        segment.timestamp = timestamp1 + t * (timestamp2 - timestamp1);
+
+        segments.push_back(segment);
+
+        segment.x1 = segment.x2;
+        segment.y1 = segment.y2;
+    }
+}
+
+/**
+ * Rebuild the state derived from the settings if they have changed since the
+ * last step. The settings are written by the main thread, so a change racing
+ * with the rebuild bumps the version again and is picked up on the next step.
+ */
+void Renderer::UpdateDerived() {
+    uint32_t version = settings.Version();
+
+    if (derived && version == derived_version &&
+        quality_level == derived_quality)
+    {
+        return;
+    }
+
+    derived = true;
+    derived_version = version;
+    derived_quality = quality_level;
+
+    Surface::DecayParameters decay_parameters[Settings::max_layers];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        GetDecayParameters(i == 1, decay_parameters);
+        surface->PrepareDecay(
+            decay_parameters, 1, quality_level == 0, decay_plans[i]
+        );
+    }
+
+    for (uint32_t i = 0; i < frame_layers; i++) UpdateAttenuation(i);
+}
+
+/**
+ * On reduced quality, bleeding is only done every other frame: the regular
+ * frames bleed twice as much, the alternate ones not at all.
+ */
+void Renderer::GetDecayParameters(
+    bool alternate,
+    Surface::DecayParameters* parameters)
+{
+    for (uint32_t i = 0; i < frame_layers; i++) {
+        float bleed = settings.Layer_bleed(i);
+
+        if (quality_level >= 1) {
+            bleed = alternate ? 0 : (bleed > .5 ? 1 : 2 * bleed);
+        }
+
+        parameters[i].bleed = bleed;
+        parameters[i].decay_exp = settings.Layer_decay_factor(i);
+        parameters[i].decay_lin = settings.Layer_decay_lin(i);
+    }
+}
+
+/**
+ * Rebuild the attenuation table by applying the exponential and linear decay
+ * to a full intensity pixel. Bleeding is ignored here, as it depends on the
+ * neighbourhood.
+ */
+void Renderer::UpdateAttenuation(uint32_t layer) {
+    float factor = 1. - settings.Layer_decay_factor(layer),
+          value = 255;
+    uint8_t lin = settings.Layer_decay_lin(layer);
+
+    for (uint32_t age = 0; age < max_attenuation_age; age++) {
+        attenuation[layer][age] = static_cast<uint8_t>(value);
+
+        value = floorf(value * factor) - lin;
+        if (value < 0) value = 0;
+    }
+}
+
+/**
+ * Draw all segments queued during this frame and a dot at the position of
+ * each active pointer. All input applied within one frame would otherwise
+ * land at full intensity, so each segment is attenuated by the decay it has
+ * missed since its event was received.
+ *
+ * Input goes to the active layer or, in color mode, to each channel with the
+ * corresponding component of the brush color. As the channels decay at
+ * different rates, each one is attenuated with its own table.
+ */
+void Renderer::RasterizePointers() {
+    uint32_t radius = settings.Radius(),
+             first_layer = settings.Layer(),
+             layer_count = 1;
+    uint8_t intensity = settings.Brush_intensity(),
+            layer_intensity[Settings::max_layers];
+
+    if (frame_color) {
+        uint32_t color = settings.Brush_color();
+
+        first_layer = 0;
+        layer_count = 3;
+
+        for (uint32_t c = 0; c < layer_count; c++) {
+            layer_intensity[c] =
+                (intensity * ((color >> (16 - 8 * c)) & 0xFF)) / 255;
+        }
+    } else {
+        layer_intensity[0] = intensity;
+    }
+
+    // The brushes are shared by the renderers on the worker.
+    Brush& brush(worker->GetBrush(settings.Brush_hardness()));
+
+    double now = pp::Module::Get()->core()->GetTimeTicks(),
+           fps = settings.Fps();
+
+    for (uint32_t c = 0; c < layer_count; c++) {
+        uint32_t layer = first_layer + c;
+
+        if (layer_intensity[c] == 0) continue;
+
+        surface->SelectLayer(layer);
+
+        for (uint32_t i = 0; i < segments.size(); i++) {
+            const Segment& segment(segments[i]);
+
+            double age = (now - segment.timestamp) * fps;
+            uint32_t index = age <= 0 ? 0 :
+                age >= max_attenuation_age ? max_attenuation_age - 1 :
+                static_cast<uint32_t>(age);
+
+            uint8_t segment_intensity =
+                (layer_intensity[c] * attenuation[layer][index]) / 255;
+            if (segment_intensity == 0) continue;
+
+            brush.Line(*surface,
+                segment.x1, segment.y1, segment.x2, segment.y2,
+                radius, segment_intensity
+            );
+        }
+
+        for (uint32_t i = 0; i < max_pointers; i++) {
+            if (pointers[i].active) {
+                // The curve ends at the previous sample, see above.
+                brush.Dot(*surface,
+                    pointers[i].x[1], pointers[i].y[1],
+                    radius, layer_intensity[c]
+                );
+            }
+        }
+    }
+
+    segments.clear();
+}
+
+void Renderer::DoDrawStroke(
+    uint32_t status,
+    const Stroke& stroke,
+    int64_t timestamp)
+{
+    if (status != PP_OK || surface == NULL || stroke.empty()) return;
+
+    Tracer::Scope scope(tracer, Tracer::PHASE_PUMP);
+    Brush& brush(worker->GetBrush(settings.Brush_hardness()));
+
+    surface->SelectLayer(stroke[0].layer);
+    brush.Dot(*surface,
+        stroke[0].x, stroke[0].y,
+        stroke[0].radius, stroke[0].intensity
+    );
+
+    for (uint32_t i = 1; i < stroke.size(); i++) {
+        surface->SelectLayer(stroke[i].layer);
+        brush.Line(*surface,
+            stroke[i-1].x, stroke[i-1].y,
+            stroke[i].x, stroke[i].y,
+            stroke[i].radius, stroke[i].intensity
+        );
+    }
+
+    if (input_timestamp == 0) input_timestamp = timestamp;
+
+    api.IncrementCounter(Api::COUNTER_STROKE_POINTS, stroke.size());
+}
+
+/**
+ * The snapshot is encoded directly from the surface in between two frames.
+ * As the surface is mostly black, this is fast enough not to disturb the
+ * loop.
+ */
+void Renderer::DoRequestSnapshot(uint32_t status) {
+    if (status != PP_OK || surface == NULL) return;
+
+    Tracer::Scope scope(tracer, Tracer::PHASE_PUMP);
+
+    snapshot_buffer.clear();
+
+    for (uint32_t i = 0; i < surface->GetPlanes(); i++) {
+        RleEncode(
+            surface->GetBuffer(i),
+            surface->GetRowSize(),
+            surface->GetHeight(),
+            surface->GetStride(),
+            snapshot_buffer
+        );
+    }
+
+    api.BroadcastSnapshot(
+        surface->GetWidth(),
+        surface->GetHeight(),
+        snapshot_buffer.empty() ? NULL : &snapshot_buffer[0],
+        snapshot_buffer.size()
     );
-    current_position = x;
 }
 
-void Renderer::DoSetDrawing(uint32_t status, bool isDrawing) {
-    if (status == PP_OK) drawing = isDrawing;
+void Renderer::DoRestoreSnapshot(
+    uint32_t status,
+    uint32_t width,
+    uint32_t height,
+    const std::vector<uint8_t>& encoded)
+{
+    if (status != PP_OK || surface == NULL) return;
+
+    Tracer::Scope scope(tracer, Tracer::PHASE_PUMP);
+
+    if (width != surface->GetWidth() || height != surface->GetHeight()) {
+        logger.Log("Snapshot size doesn't match the surface.",
+            Logger::LEVEL_WARNING);
+        return;
+    }
+
+    // The planes are encoded one after the other. A failed decode leaves
+    // the surface partially overwritten, so we clear it in this case.
+    const uint8_t* data = encoded.empty() ? NULL : &encoded[0];
+    uint32_t offset = 0;
+    bool success = true;
+
+    for (uint32_t i = 0; success && i < surface->GetPlanes(); i++) {
+        success = RleDecode(data, encoded.size(), offset, surface->GetBuffer(i),
+            surface->GetRowSize(), height, surface->GetStride());
+    }
+
+    if (!success || offset != encoded.size()) {
+        surface->Clear();
+        logger.Log("Invalid snapshot data.", Logger::LEVEL_WARNING);
+    }
 }
 
 /**
- * The main loop.
+ * Set up the loop state on the first step after attaching. Restoring the
+ * surface blocks, but we are on the simulation thread and nothing is
+ * displayed yet anyway.
  */
-void Renderer::Dispatch() {
-    pp::Size extent = graphics->size();
-    surface = new Surface(extent.width(), extent.height());
+void Renderer::BeginSimulation(const timeval& timestamp) {
+    if (!persistence_name.empty() && persistence == NULL) {
+        persistence = new Persistence(handle, logger, persistence_name);
 
-    timeval timestamp, fps_reference;
-    uint32_t render_counter = 0, processing_counter = 0;
+        if (!persistence->Open(*surface, !persistence_restored)) {
+            delete persistence;
+            persistence = NULL;
+        }
+
+        persistence_restored = true;
+    }
 
     // Initialize the reference timestamp for FPS calculation
-    if (gettimeofday(&fps_reference, NULL) != 0) return;
+    fps_reference = timestamp;
+    persistence_reference = timestamp;
+    previous_timestamp = timestamp;
+    frame_reference = timestamp;
+    processing_counter = 0;
+    processing_time = 0;
+    jitter_sum = jitter_max = 0;
+    jitter_counter = 0;
 
     // Broadcast the reference FPS as initial value
-    api.BroadcastFps(settings.Fps(), settings.Fps());
+    api.SetGauge(Api::GAUGE_PROCESSING_FPS, settings.Fps());
+    api.SetGauge(Api::GAUGE_RENDERING_FPS, settings.Fps());
+    api.SetGauge(Api::GAUGE_QUALITY_LEVEL, quality_level);
+
+    input_timestamp = 0;
+    simulating = true;
 
     logger.Log("Rendering loop started.");
+}
 
-    render_pending = false;
+/**
+ * Called on the simulation thread when the renderer is detached. Pending
+ * writes are aborted, so the file may lag up to one sync interval behind.
+ */
+void Renderer::EndSimulation() {
+    delete persistence;
+    persistence = NULL;
+    simulating = false;
+
+    logger.Log("Rendering loop finished.");
+}
 
-    while (true) {
-        if (gettimeofday(&timestamp, NULL) != 0) break;
+/**
+ * One iteration of the main loop. This is the simulation stage of the
+ * pipeline, presentation happens asynchronously on the presentation thread.
+ * Work posted to the renderer has been processed since the previous step.
+ */
+bool Renderer::Step() {
+    timeval timestamp;
+    bool published = false;
 
-        surface->Decay(
-            settings.Bleed(),
-            settings.Decay_factor(),
-            settings.Decay_lin()
-        );
+    if (gettimeofday(&timestamp, NULL) != 0) return false;
 
-        if (!PumpMessageLoop()) break;
+    if (!simulating) {
+        BeginSimulation(timestamp);
+    } else if (settings.Throttle()) {
+        // The scheduling jitter is the delay of the step w.r.t. its due
+        // time. Steps may start slightly early, see Worker.
+        int64_t lateness = static_cast<int64_t>(timestamp.tv_sec) * 1000000 +
+            timestamp.tv_usec - due;
 
-        if (drawing){
-            surface->Circle(
-                current_position.x(),
-                current_position.y(),
-                settings.Radius()
-            );
+        if (lateness < 0) lateness = 0;
+        if (lateness > jitter_max) jitter_max = lateness;
+
+        jitter_sum += lateness;
+        jitter_counter++;
+    }
+
+    UpdateDerived();
+
+    // Unthrottled, the simulation runs on frames instead of the clock. Missed
+    // steps are only applied exactly while there is headroom, as that costs
+    // as much as the single steps would have.
+    bool throttle = settings.Throttle(),
+         alternate = quality_level >= 1 && frame_counter % 2;
+    uint32_t steps = throttle ? DecaySteps(previous_timestamp, timestamp) : 1;
+
+    {
+        Tracer::Scope scope(tracer, Tracer::PHASE_DECAY);
+
+        // Only a stall needs a plan of its own.
+        if (steps == 1) {
+            surface->Decay(decay_plans[alternate]);
+        } else {
+            Surface::DecayParameters decay_parameters[Settings::max_layers];
+
+            GetDecayParameters(alternate, decay_parameters);
+            surface->Decay(decay_parameters, steps, quality_level == 0);
         }
+    }
+
+    previous_timestamp = timestamp;
 
-        // Checking whether the previous render request has completed
-        // before rendering avoid unnecessary work and allows us to count
-        // the rendering FPS separately from the processing FPS.
-        if (!render_pending) {
-            render_counter++;
-            render_pending = true;
-            RenderSurface();
+    {
+        Tracer::Scope scope(tracer, Tracer::PHASE_DRAW);
+        RasterizePointers();
+    }
+
+    // Headless frames are only published at the frame interval.
+    if (graphics == NULL) {
+        if (TimeDifference(frame_reference, timestamp) >=
+            static_cast<int32_t>(settings.Frame_interval() * 1000))
+        {
+            PublishFrame();
+            frame_reference = timestamp;
+            published = true;
         }
+    } else if (quality_level < 2 || frame_counter % 2 == 0) {
+        PublishFrame();
+        published = true;
+    }
 
-        processing_counter++;
+    frame_counter++;
+    processing_counter++;
 
-        if (!processFps(fps_reference, processing_counter, render_counter)) break;
+    timeval finished;
+    if (gettimeofday(&finished, NULL) != 0) return published;
+    processing_time += TimeDifference(timestamp, finished);
 
-        delay(timestamp, 1000000 / settings.Fps());
+    processFps();
+
+    if (persistence != NULL &&
+        TimeDifference(persistence_reference, timestamp) >
+            static_cast<int32_t>(persistence_interval * 1000000))
+    {
+        persistence->Sync(*surface);
+        persistence_reference = timestamp;
     }
 
-    logger.Log("Rendering loop finished.");
+    // Steps are aligned to multiples of the frame period, so renderers with
+    // the same target FPS share their ticks.
+    int64_t now = Timestamp(),
+            period = 1000000 / settings.Fps();
+
+    due = throttle ? (now / period + 1) * period : now;
+
+    return published;
 }
 
-bool Renderer::PumpMessageLoop() {
-    // pp::AutoLock is a useful little helper which acquires a lock on
-    // creation and releases it on destruction. This allows us to quit the
-    // function anytime without caring about manually releasing the lock.
-    pp::AutoLock lock(message_loop_lock);
-    pp::MessageLoop& message_loop(thread->message_loop());
+/**
+ * The number of decay steps which have elapsed since the previous frame. This
+ * is one unless the loop has stalled or can't keep up, in which case the
+ * surface catches up with the wall clock in a single pass. Jitter is absorbed
+ * by rounding.
+ */
+uint32_t Renderer::DecaySteps(const timeval& previous, const timeval& current) {
+    int32_t period = 1000000 / settings.Fps(),
+            elapsed = TimeDifference(previous, current);
 
-    // Calling PostQuit(false) posts a quit message without closing the
-    // loop. This ensures that Run() returns after all messages have
-    // been processed, effectively polling the loop.
-    //
-    // If quit requested is set, we must assume that the loop has been closed
-    // for good and return immediatelly.
-    if (quit_requested) return false;
-    if (message_loop.PostQuit(false) != PP_OK) return false;
-    if (message_loop.Run() != PP_OK) return false;
+    if (elapsed <= period) return 1;
 
-    return true;
+    uint32_t steps = (elapsed + period / 2) / period;
+
+    return steps > max_decay_steps ? max_decay_steps : steps;
+}
+
+/**
+ * Copy the completed frame to the triple buffer. The worker notifies the
+ * presentation thread at the end of the tick. If the presentation thread
+ * falls behind, unconsumed frames are simply overwritten by the next one.
+ */
+void Renderer::PublishFrame() {
+    Tracer::Scope scope(tracer, Tracer::PHASE_PUBLISH);
+
+    uint32_t plane_size = frames->GetSize() / frame_planes;
+    uint8_t* frame = frames->GetBackBuffer();
+
+    for (uint32_t i = 0; i < frame_planes; i++) {
+        memcpy(frame + i * plane_size, surface->GetBuffer(i), plane_size);
+    }
+
+    frames->Publish(input_timestamp, Timestamp());
+    input_timestamp = 0;
 }
 
 /**
  * Each second we calculate calculate the FPS rendered and processed and
- * broadcast them via the API.
+ * report them via the API together with the average latency between input
+ * and display. The average processing time per frame drives the quality
+ * level.
  */
-bool Renderer::processFps(
-    timeval& fps_reference,
-    uint32_t& processing_counter,
-    uint32_t& rendering_counter)
-{
+bool Renderer::processFps() {
     timeval measurement;
     if (gettimeofday(&measurement, NULL) != 0) return false;
 
     float time_difference = TimeDifference(fps_reference, measurement) / 1000000.;
     if (time_difference > 1.) {
+        // The counters are updated by the presentation thread, so we read and
+        // reset them atomically. The latency sum and count may be off by one
+        // frame relative to each other, which we don't care about.
+        uint32_t rendering_counter = __sync_fetch_and_and(&render_counter, 0),
+                 latency_total = __sync_fetch_and_and(&latency_sum, 0),
+                 latency_frames = __sync_fetch_and_and(&latency_counter, 0),
+                 display_total =
+                    __sync_fetch_and_and(&display_latency_sum, 0),
+                 display_frames =
+                    __sync_fetch_and_and(&display_latency_counter, 0);
+
         float processing_fps =
                 static_cast<float>(processing_counter) / time_difference,
               rendering_fps =
-                static_cast<float>(rendering_counter) / time_difference;
+                static_cast<float>(rendering_counter) / time_difference,
+              latency = latency_frames > 0 ?
+                static_cast<float>(latency_total) / latency_frames / 1000. : 0,
+              display_latency = display_frames > 0 ?
+                static_cast<float>(display_total) / display_frames / 1000. : 0;
+
+        api.SetGauge(Api::GAUGE_PROCESSING_FPS, processing_fps);
+        api.SetGauge(Api::GAUGE_RENDERING_FPS, rendering_fps);
+        api.SetGauge(Api::GAUGE_LATENCY, latency);
+        api.SetGauge(Api::GAUGE_DISPLAY_LATENCY, display_latency);
 
-        api.BroadcastFps(processing_fps, rendering_fps);
+        // Without throttling there are no samples, which is reported as zero
+        // rather than leaving the last value on display.
+        api.SetGauge(Api::GAUGE_JITTER, jitter_counter > 0 ?
+            static_cast<float>(jitter_sum) / jitter_counter / 1000. : 0);
+        api.SetGauge(Api::GAUGE_MAX_JITTER, jitter_max / 1000.);
 
-        processing_counter = rendering_counter = 0;
+        jitter_sum = jitter_max = 0;
+        jitter_counter = 0;
+
+        // Without throttling, the load is meaningless.
+        if (processing_counter > 0 && settings.Throttle()) {
+            AdaptQuality(static_cast<float>(processing_time) /
+                processing_counter * settings.Fps() / 1000000.);
+        }
+
+        processing_counter = 0;
+        processing_time = 0;
         fps_reference = measurement;
     }
 
@@ -301,47 +894,316 @@ bool Renderer::processFps(
 }
 
 /**
- * Copy the surface data to the graphics context.
+ * The load is the fraction of the frame period spent processing.
  */
-void Renderer::RenderSurface() {
+void Renderer::AdaptQuality(float load) {
+    uint32_t level = quality_level;
+
+    if (load > .9) {
+        if (level < max_quality_level) level++;
+        quality_headroom = 0;
+    } else if (load < .5 && level > 0) {
+        if (++quality_headroom >= quality_headroom_seconds) {
+            level--;
+            quality_headroom = 0;
+        }
+    } else {
+        quality_headroom = 0;
+    }
+
+    if (level != quality_level) {
+        quality_level = level;
+        api.SetGauge(Api::GAUGE_QUALITY_LEVEL, quality_level);
+    }
+}
+
+/**
+ * Allocate the image buffers. Zero initialization is not necessary as each
+ * buffer is completely overwritten before being presented.
+ */
+void Renderer::AllocateImageRing() {
     pp::Size extent = graphics->size();
 
-    // Aquire an image data buffer from pepper. According to the docs, the
-    // buffers are cached internally and reused.
-    pp::ImageData image_data(handle, PP_IMAGEDATAFORMAT_RGBA_PREMUL, extent, false);
+    for (uint32_t i = 0; i < image_ring_size; i++) {
+        image_ring[i] = new pp::ImageData(
+            handle, PP_IMAGEDATAFORMAT_RGBA_PREMUL, extent, false);
+        image_ring_timestamp[i] = 0;
+        image_ring_completion[i] = 0;
+    }
+
+    image_ring_index = 0;
+}
+
+void Renderer::ReleaseImageRing() {
+    for (uint32_t i = 0; i < image_ring_size; i++) {
+        delete image_ring[i];
+        image_ring[i] = NULL;
+    }
+}
 
-    uint8_t* surface_buffer = surface->GetBuffer();
-    uint32_t* image_buffer = static_cast<uint32_t*>(image_data.data());
+/**
+ * Pick up the palettes staged by SetPalette.
+ */
+void Renderer::UpdatePalettes() {
+    if (palette_dirty == 0) return;
 
-    uint32_t area = extent.GetArea();
+    pp::AutoLock lock(palette_lock);
 
-    // Copy the surface data to the buffer
-    for (uint32_t i = 0; i < area; i++) {
-        image_buffer[i] =
-            PixelRGB(surface_buffer[i], surface_buffer[i], surface_buffer[i]);
+    for (uint32_t i = 0; i < Settings::max_layers; i++) {
+        if (palette_dirty & (1 << i)) {
+            memcpy(palette[i], staged_palette[i], sizeof(palette[i]));
+        }
     }
 
+    palette_dirty = 0;
+}
+
+/**
+ * Copy the front frame of the triple buffer to the current buffer in the
+ * image ring.
+ */
+void Renderer::RenderSurface() {
+    Tracer::Scope scope(tracer, Tracer::PHASE_CONVERT);
+
+    UpdatePalettes();
+
+    pp::ImageData& image_data(*image_ring[image_ring_index]);
+    pp::Size extent = image_data.size();
+
+    const uint8_t* frame = frames->GetFrontBuffer();
+    uint8_t* image_row = static_cast<uint8_t*>(image_data.data());
+
+    uint32_t width = extent.width(),
+             height = extent.height(),
+             stride = image_data.stride(),
+             plane_size = frames->GetSize() / frame_planes;
+
+    // In color mode, the frame already has the byte order of the image, so
+    // we only have to fill in the blank alpha channel.
+    if (frame_color) {
+        for (uint32_t y = 0; y < height; y++) {
+            uint32_t* image_buffer = reinterpret_cast<uint32_t*>(image_row);
+            const uint32_t* surface_buffer =
+                reinterpret_cast<const uint32_t*>(frame + y * frame_stride);
+
+            for (uint32_t x = 0; x < width; x++) {
+                image_buffer[x] = surface_buffer[x] | 0xFF000000;
+            }
+
+            image_row += stride;
+        }
+
+        image_ring_timestamp[image_ring_index] = frames->GetFrontTimestamp();
+        image_ring_completion[image_ring_index] = frames->GetFrontCompletion();
+        return;
+    }
+
+    // Copy the surface data to the buffer. Both the surface and pepper pad
+    // the rows, so we have to honour both strides. Further layers are added
+    // on top of the first one.
+    for (uint32_t y = 0; y < height; y++) {
+        uint32_t* image_buffer = reinterpret_cast<uint32_t*>(image_row);
+        const uint8_t* surface_buffer = frame + y * frame_stride;
+
+        for (uint32_t x = 0; x < width; x++) {
+            image_buffer[x] = palette[0][surface_buffer[x]];
+        }
+
+        for (uint32_t i = 1; i < frame_planes; i++) {
+            const uint32_t* layer_palette = palette[i];
+            surface_buffer += plane_size;
+
+            for (uint32_t x = 0; x < width; x++) {
+                image_buffer[x] = PixelAdd(
+                    image_buffer[x], layer_palette[surface_buffer[x]]);
+            }
+        }
+
+        image_row += stride;
+    }
+
+    image_ring_timestamp[image_ring_index] = frames->GetFrontTimestamp();
+    image_ring_completion[image_ring_index] = frames->GetFrontCompletion();
+}
+
+/**
+ * Box filter the front frame of the triple buffer and hand it to the API. The
+ * edges which don't fill a whole box are dropped. In color mode, the alpha
+ * channel is filled in, so the frame can be used as image data right away.
+ * Delivered frames count as rendered.
+ */
+void Renderer::DeliverFrame() {
+    Tracer::Scope scope(tracer, Tracer::PHASE_CONVERT);
+
+    const uint8_t* frame = frames->GetFrontBuffer();
+    uint32_t channels = frame_color ? 4 : 1,
+             downsample = settings.Frame_downsample(),
+             plane_size = frames->GetSize() / frame_planes;
+
+    if (downsample > static_cast<uint32_t>(headless_extent.width())) {
+        downsample = headless_extent.width();
+    }
+    if (downsample > static_cast<uint32_t>(headless_extent.height())) {
+        downsample = headless_extent.height();
+    }
+    if (downsample == 0) return;
+
+    uint32_t width = headless_extent.width() / downsample,
+             height = headless_extent.height() / downsample,
+             row_size = width * channels,
+             area = downsample * downsample;
+
+    downsample_buffer.resize(frame_planes * height * row_size);
+    downsample_sums.resize(row_size);
+
+    uint8_t* target = &downsample_buffer[0];
+
+    for (uint32_t i = 0; i < frame_planes; i++) {
+        for (uint32_t y = 0; y < height; y++) {
+            std::fill(downsample_sums.begin(), downsample_sums.end(), 0);
+
+            for (uint32_t k = 0; k < downsample; k++) {
+                const uint8_t* source = frame + i * plane_size +
+                    (y * downsample + k) * frame_stride;
+
+                for (uint32_t x = 0; x < width; x++) {
+                    uint32_t* sums = &downsample_sums[x * channels];
+
+                    for (uint32_t j = 0; j < downsample * channels; j++) {
+                        sums[j % channels] += source[j];
+                    }
+
+                    source += downsample * channels;
+                }
+            }
+
+            for (uint32_t x = 0; x < row_size; x++) {
+                target[x] = downsample_sums[x] / area;
+            }
+            if (frame_color) {
+                for (uint32_t x = 3; x < row_size; x += 4) target[x] = 0xFF;
+            }
+
+            target += row_size;
+        }
+    }
+
+    AccountFrame(frames->GetFrontTimestamp(), frames->GetFrontCompletion());
+
+    api.BroadcastFrame(width, height, downsample,
+        downsample_buffer.empty() ? NULL : &downsample_buffer[0],
+        downsample_buffer.size());
+}
+
+/**
+ * Present the current buffer in the image ring and advance the ring.
+ */
+void Renderer::PresentFrame() {
+    Tracer::Scope scope(tracer, Tracer::PHASE_FLUSH);
+
     // Calling ReplaceContents replaces the buffer of the graphics context with
-    // our freshly populated buffer. The previously bound buffer is freed and
-    // will be recycled in our next iteration. This is how the pepper docs
-    // advise for implementing double buffering :)
-    graphics->ReplaceContents(&image_data);
+    // our freshly populated buffer. It resets the image it is passed, so we
+    // pass a copy of the handle and the ring keeps its own. The buffer which
+    // was displayed before is released by the graphics context once the
+    // flush has completed. As at most one flush is in flight at any time, the
+    // next buffer in the ring was displayed two flushes ago and is free when
+    // we get to it.
+    pp::ImageData image(*image_ring[image_ring_index]);
+    graphics->ReplaceContents(&image);
 
     // ReplaceContents only queues the operation, we need to call Flush in order
     // to actually dispatch it. Flush returns immediatelly, and the callback is
-    // executed when the operation has actually completed. Passing an empty
-    // callback would block the thread until the operation has completed and
-    // enforce synchrouneous operation. However, keeping it async allows us to
-    // process at a constant frame rate even if rendering is too slow.
-    graphics->Flush(callback_factory->NewCallback(&Renderer::RenderCallback));
+    // executed on the presentation thread when the operation has actually
+    // completed.
+    graphics->Flush(worker->NewFlushCallback(this));
+
+    image_ring_index = (image_ring_index + 1) % image_ring_size;
+    render_pending = true;
+    frame_staged = false;
+}
+
+/**
+ * Called on the presentation thread after attaching. Flushes issued by a
+ * previous worker have been aborted, so nothing is pending.
+ */
+void Renderer::BeginPresentation() {
+    render_pending = false;
+    frame_staged = false;
+}
+
+/**
+ * Called on the presentation thread whenever the simulation has published a
+ * frame. If no flush is pending, the frame is presented right away; otherwise
+ * it is staged in the next free buffer.
+ */
+void Renderer::Present() {
+    if (!frames->Acquire()) return;
+
+    if (graphics == NULL) {
+        DeliverFrame();
+        return;
+    }
+
+    RenderSurface();
+
+    if (render_pending) {
+        frame_staged = true;
+    } else {
+        PresentFrame();
+    }
 }
 
 /**
- * The callback just lowers the render_pending flag, clearing the way for a new
- * render operation.
+ * Account for a frame which has just been displayed (or delivered). The input
+ * latency is measured from the oldest input contained in the frame, the
+ * display latency from the completion of the frame by the simulation.
+ */
+void Renderer::AccountFrame(int64_t timestamp, int64_t completion) {
+    int64_t now = Timestamp();
+
+    __sync_fetch_and_add(&render_counter, 1);
+
+    if (timestamp > 0) {
+        __sync_fetch_and_add(&latency_sum,
+            static_cast<uint32_t>(now - timestamp));
+        __sync_fetch_and_add(&latency_counter, 1);
+    }
+
+    if (completion > 0) {
+        __sync_fetch_and_add(&display_latency_sum,
+            static_cast<uint32_t>(now - completion));
+        __sync_fetch_and_add(&display_latency_counter, 1);
+
+        tracer.Counter(Tracer::PHASE_DISPLAY_LATENCY, now - completion);
+    }
+}
+
+/**
+ * The callback lowers the render_pending flag and accounts for the frame which
+ * has just hit the screen. If a frame has been staged or published in the
+ * meantime, it is presented right away, so presentation follows the flush
+ * completions and never waits for the next simulation step.
  */
 void Renderer::RenderCallback(uint32_t status) {
     render_pending = false;
+    if (status != PP_OK) return;
+
+    Tracer::Scope scope(tracer, Tracer::PHASE_FLUSH_CALLBACK);
+
+    uint32_t displayed =
+        (image_ring_index + image_ring_size - 1) % image_ring_size;
+
+    AccountFrame(
+        image_ring_timestamp[displayed],
+        image_ring_completion[displayed]
+    );
+
+    if (frame_staged) {
+        PresentFrame();
+    } else if (frames->Acquire()) {
+        RenderSurface();
+        PresentFrame();
+    }
 }
 
 }
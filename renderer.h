@@ -28,23 +28,39 @@
 #include <sys/time.h>
 
 #include "ppapi/cpp/message_loop.h"
-#include "ppapi/utility/threading/simple_thread.h"
 #include "ppapi/utility/threading/lock.h"
 #include "ppapi/utility/completion_callback_factory.h"
 #include "ppapi/cpp/graphics_2d.h"
+#include "ppapi/cpp/image_data.h"
 #include "ppapi/cpp/instance_handle.h"
 #include "ppapi/cpp/point.h"
 
+#include <vector>
 
 #include "logger.h"
 #include "surface.h"
 #include "settings.h"
 #include "api.h"
+#include "triple_buffer.h"
+#include "stroke.h"
+#include "pointer.h"
+#include "brush.h"
+#include "persistence.h"
+#include "scheduler.h"
+#include "trace.h"
 
 namespace glow {
 
 /**
- * The renderer handles the main loop.
+ * The renderer handles the main loop. Processing is split into two pipeline
+ * stages which run on separate threads: the simulation thread advances the
+ * surface and publishes each completed frame through a triple buffer, while
+ * the presentation thread converts and flushes the latest completed frame.
+ *
+ * The threads are shared with the renderers of other instances: the renderer
+ * is attached to a Worker of the module's Scheduler, which calls Step on the
+ * simulation thread whenever a frame is due and Present on the presentation
+ * thread after a frame has been published.
  */
 class Renderer {
     public:
@@ -53,44 +69,72 @@ class Renderer {
             const pp::InstanceHandle& handle,
             Logger& logger,
             Api& api,
+            Tracer& tracer,
             const volatile Settings& settings,
             pp::Graphics2D* graphics
         );
         ~Renderer();
 
         /*
-         * Start and stop the thread
+         * Attach to and detach from the scheduler. Stop blocks until the
+         * worker has let go of the renderer.
          */
         void Start();
         void Stop();
 
         /**
-         * These turtle-like graphics methods provide the external interface
-         * available to the main thread.
+         * Keep the surface in the named file on the persistent file system,
+         * see Persistence. Must be called before Start.
          */
-        void MoveTo(const pp::Point& x);
-        void DrawTo(const pp::Point& x);
-        void SetDrawing(bool drawing);
+        void EnablePersistence(const std::string& name);
+
+        /**
+         * Run without a graphics context on a surface of the given size.
+         * Instead of being displayed, frames are downsampled and delivered
+         * via the API at the frame interval. Must be called before Start,
+         * and the renderer must have been created without a graphics
+         * context.
+         */
+        void EnableHeadless(const pp::Size& extent);
+
+        /**
+         * Pointer input is the external interface available to the main
+         * thread. All events extracted from a single input event are
+         * passed in one go.
+         */
+        void HandlePointerEvents(const PointerEvents& events);
+
+        /**
+         * Bulk operations for the binary API. A stroke is drawn as a whole
+         * in a single pass on the rendering thread. Snapshots are run-length
+         * encoded (see rle.h), one layer after the other. Each layer has a
+         * palette which maps intensity to premultiplied RGBA and must have
+         * 256 entries. The layers are composited additively.
+         */
+        void DrawStroke(const Stroke& stroke);
+        void RequestSnapshot();
+        void RestoreSnapshot(
+            uint32_t width,
+            uint32_t height,
+            const std::vector<uint8_t>& encoded
+        );
+        void SetPalette(uint32_t layer, const std::vector<uint32_t>& palette);
 
     private:
+
+        friend class Worker;
    
         pp::InstanceHandle handle;
         Logger& logger;
         Api& api;
+        Tracer& tracer;
         pp::Graphics2D* graphics;
 
         /**
-         * pp::SimpleThread is a simple wrapper around a pthread and also
-         * automatically creates a message loop for the thread.
-         */
-        pp::SimpleThread* thread;
-
-        /**
-         * We need those in order to make sure that the message loop will not
-         * be polled again before joining threads and stopping the renderer.
+         * The worker we are attached to, NULL while stopped. Work is posted
+         * to its simulation thread.
          */
-        pp::Lock message_loop_lock;
-        bool quit_requested;
+        Worker* worker;
 
         /**
          * pp::CompletionCallbackFactory allows to create
@@ -100,9 +144,185 @@ class Renderer {
          */
         pp::CompletionCallbackFactory<Renderer>* callback_factory;
 
+        /**
+         * A frame holds the planes of the surface back to back, each padded
+         * like the surface rows. In color mode, there is a single plane with
+         * the layout of an RGBA image.
+         */
         Surface* surface;
+        TripleBuffer* frames;
+        uint32_t frame_stride, frame_layers, frame_planes;
+        bool frame_color;
+
+        /**
+         * Persistence is created and used on the rendering thread. The
+         * surface is synced every persistence_interval seconds. It is only
+         * restored from the file on the first attach after Start; when the
+         * scheduler moves the renderer to another worker, the live surface
+         * is kept.
+         */
+        std::string persistence_name;
+        Persistence* persistence;
+        bool persistence_restored;
+        static const uint32_t persistence_interval = 2;
+
+        /**
+         * After a stall, the missed decay steps are applied in one pass. At
+         * full quality, a few steps are applied exactly (see Surface::Decay),
+         * otherwise they are composed. The cost of the composed pass doesn't
+         * depend on the number of steps, and beyond this bound the surface
+         * has long faded anyway.
+         */
+        static const uint32_t max_decay_steps = 1024;
+
+        /**
+         * If the device can't sustain the target frame rate, quality is
+         * traded for speed in steps. Each level includes the previous ones:
+         *
+         *  1. bleeding is applied every other frame only (with twice the
+         *     bleed), and missed decay steps are always composed
+         *  2. only every other frame is published for presentation
+         *
+         * The level is adapted once per second based on the fraction of the
+         * frame period spent processing. It is lowered right away if the
+         * loop is overloaded, but only raised after headroom has been
+         * available for a couple of seconds in order to avoid oscillation.
+         */
+        static const uint32_t max_quality_level = 2;
+        static const uint32_t quality_headroom_seconds = 5;
+        uint32_t quality_level;
+        uint32_t quality_headroom;
+        uint32_t frame_counter;
+
+        /**
+         * The state of the main loop, carried from one step to the next.
+         * due is the time of the next step in microseconds. The loop state
+         * is initialized on the first step after attaching. The jitter
+         * statistics (how late the steps start) are reported together with
+         * the FPS.
+         */
+        bool simulating;
+        int64_t due;
+        timeval previous_timestamp, fps_reference, persistence_reference,
+                frame_reference;
+        uint32_t processing_counter;
+        int64_t processing_time;
+        int64_t jitter_sum, jitter_max;
+        uint32_t jitter_counter;
+
+        /**
+         * Each active pointer (mouse or finger) has a slot in a fixed size
+         * table. Moves only queue segments, which are rasterized together
+         * once per frame.
+         *
+         * The path of a pointer is smoothed with a Catmull-Rom spline, so we
+         * keep the last three samples (the newest one last). The curve lags
+         * one sample behind, as the segment leading up to a sample can only
+         * be drawn once the next sample is known.
+         */
+        struct Pointer {
+            bool active;
+            uint32_t id;
+            float x[3], y[3];
+            double timestamp[3];
+        };
+
+        /**
+         * The timestamp of a segment is that of its end point. It is used
+         * to attenuate the segment by the decay it would have received if
+         * it had been drawn at the time of the input event.
+         */
+        struct Segment {
+            float x1, y1, x2, y2;
+            double timestamp;
+        };
+
+        static const uint32_t max_pointers = 16;
+        Pointer pointers[max_pointers];
+        std::vector<Segment> segments;
+
+        /**
+         * The attenuation table of a layer maps the age of a segment in
+         * frames to the intensity a full intensity pixel would have decayed
+         * to.
+         */
+        static const uint32_t max_attenuation_age = 256;
+        uint8_t attenuation[Settings::max_layers][max_attenuation_age];
+
+        /**
+         * State derived from the settings is only rebuilt on the simulation
+         * thread when the settings version or the quality level has changed,
+         * so a regular step does no floating point setup. The second decay
+         * plan is used on odd frames when bleeding is done every other frame
+         * only.
+         */
+        bool derived;
+        uint32_t derived_version, derived_quality;
+        Surface::DecayPlan decay_plans[2];
+
+        /**
+         * Encoding buffer for snapshots, kept around in order to avoid
+         * reallocation.
+         */
+        std::vector<uint8_t> snapshot_buffer;
+
+        /**
+         * The timestamp of the oldest input which has been applied to the
+         * surface but not yet published. Zero if there is none.
+         */
+        int64_t input_timestamp;
+
+        /**
+         * The surface size in headless mode, empty otherwise.
+         */
+        pp::Size headless_extent;
+
+        /**
+         * The following members belong to the presentation thread.
+         *
+         * Instead of acquiring a fresh pp::ImageData for every frame, we
+         * preallocate a small ring of buffers and rotate through them. With
+         * one buffer on screen and one in flight, the third one can be
+         * populated with the next frame while the previous flush is still
+         * pending. The staged frame is then presented directly from the
+         * flush callback. Each buffer keeps the timestamps of the frame it
+         * holds for the latency measurement.
+         *
+         * As the flushes are issued and completed on the presentation
+         * thread, the flags need no synchronization.
+         */
+        static const uint32_t image_ring_size = 3;
+        pp::ImageData* image_ring[image_ring_size];
+        int64_t image_ring_timestamp[image_ring_size];
+        int64_t image_ring_completion[image_ring_size];
+        uint32_t image_ring_index;
         bool render_pending;
-        bool drawing;
+        bool frame_staged;
+        uint32_t palette[Settings::max_layers][256];
+
+        /**
+         * New palettes are staged by the main thread and picked up by the
+         * presentation thread before the next conversion. The dirty mask
+         * has one bit per layer.
+         */
+        pp::Lock palette_lock;
+        uint32_t staged_palette[Settings::max_layers][256];
+        volatile uint32_t palette_dirty;
+
+        /**
+         * Headless frames are downsampled into these, kept around in order
+         * to avoid reallocation.
+         */
+        std::vector<uint8_t> downsample_buffer;
+        std::vector<uint32_t> downsample_sums;
+
+        /**
+         * Statistics shared between the two threads. These are only updated
+         * with atomic builtins. Latencies are summed up in microseconds.
+         */
+        volatile uint32_t render_counter;
+        volatile uint32_t latency_sum, latency_counter;
+        volatile uint32_t display_latency_sum, display_latency_counter;
 
         /**
          * We are going to modify those from the main thread, so we add
@@ -110,32 +330,63 @@ class Renderer {
          */
         const volatile Settings& settings;
 
-        pp::Point current_position;
-
         /**
-         * The main loop.
+         * Called by the worker on the simulation thread: advance by one
+         * iteration of the main loop and return whether a frame has been
+         * published. GetDue is the time of the next step.
          */
-        void Dispatch();
+        bool Step();
+        void BeginSimulation(const timeval& timestamp);
+        void EndSimulation();
+
+        int64_t GetDue() const {
+            return due;
+        }
+
+        uint32_t DecaySteps(const timeval& previous, const timeval& current);
+        void PublishFrame();
 
         /**
-         * The static dispatcher is called upon thread creation and transfers
-         * control to the main loop on the instance.
+         * Called by the worker on the presentation thread.
          */
-        static void DispatchThreadCallback(pp::MessageLoop&, void* userdata);
+        void BeginPresentation();
+        void Present();
+        void RenderCallback(uint32_t status);
 
-        bool PumpMessageLoop();
+        void AllocateImageRing();
+        void ReleaseImageRing();
+        void UpdatePalettes();
         void RenderSurface();
-        void RenderCallback(uint32_t status);
+        void DeliverFrame();
+        void PresentFrame();
+        void AccountFrame(int64_t timestamp, int64_t completion);
+
+        bool processFps();
+        void AdaptQuality(float load);
 
-        bool processFps(
-            timeval& fps_reference,
-            uint32_t& processing_counter,
-            uint32_t& render_counter
+        Pointer* FindPointer(uint32_t id);
+        void QueueCurve(Pointer& pointer, float x, float y, double timestamp);
+        void UpdateDerived();
+        void UpdateAttenuation(uint32_t layer);
+        void GetDecayParameters(
+            bool alternate,
+            Surface::DecayParameters* parameters
         );
+        void RasterizePointers();
 
-        void DoMoveTo(uint32_t status, const pp::Point& x);
-        void DoDrawTo(uint32_t status, const pp::Point& x);
-        void DoSetDrawing(uint32_t status, bool drawing);
+        void DoHandlePointerEvents(
+            uint32_t status,
+            const PointerEvents& events,
+            int64_t timestamp
+        );
+        void DoDrawStroke(uint32_t status, const Stroke& stroke, int64_t timestamp);
+        void DoRequestSnapshot(uint32_t status);
+        void DoRestoreSnapshot(
+            uint32_t status,
+            uint32_t width,
+            uint32_t height,
+            const std::vector<uint8_t>& encoded
+        );
 
         Renderer(const Renderer&);
         const Renderer& operator=(const Renderer&);
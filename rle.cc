@@ -0,0 +1,239 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "rle.h"
+
+#include <cstring>
+
+namespace {
+
+enum TokenType {
+    TOKEN_ZERO = 0,
+    TOKEN_REPEAT = 1,
+    TOKEN_LITERAL = 2
+};
+
+/**
+ * Repeats shorter than this are cheaper to encode as part of a literal run.
+ */
+const uint32_t min_repeat = 4;
+
+void PutToken(std::vector<uint8_t>& out, TokenType type, uint32_t length) {
+    uint64_t value = (static_cast<uint64_t>(length) << 2) | type;
+
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool GetToken(
+    const uint8_t* data,
+    uint32_t length,
+    uint32_t& offset,
+    uint32_t& type,
+    uint32_t& run)
+{
+    uint64_t value = 0;
+    uint32_t shift = 0;
+
+    while (true) {
+        if (offset >= length || shift > 35) return false;
+
+        uint8_t byte = data[offset++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+
+        if (!(byte & 0x80)) break;
+    }
+
+    type = value & 0x03;
+    run = static_cast<uint32_t>(value >> 2);
+
+    return true;
+}
+
+/**
+ * The length of the run of identical bytes starting at the given position.
+ */
+uint32_t RunLength(const uint8_t* buffer, uint32_t position, uint32_t size) {
+    uint8_t value = buffer[position];
+    uint32_t end = position + 1;
+
+    // Most of the surface is black, so we skip zeros a word at a time.
+    if (value == 0) {
+        while (end + sizeof(uint32_t) <= size) {
+            uint32_t word;
+            memcpy(&word, buffer + end, sizeof(word));
+
+            if (word != 0) break;
+            end += sizeof(word);
+        }
+    }
+
+    while (end < size && buffer[end] == value) end++;
+
+    return end - position;
+}
+
+}
+
+namespace glow {
+
+/**
+ * The rows are encoded one by one. Runs of zeros are carried over to the next
+ * row, so blank areas still collapse into a single token.
+ */
+void RleEncode(
+    const uint8_t* buffer,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride,
+    std::vector<uint8_t>& out)
+{
+    uint32_t zeros = 0;
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* row = buffer + y * stride;
+        uint32_t position = 0,
+                 literal_start = 0;
+
+        while (position < width) {
+            uint32_t run = RunLength(row, position, width);
+            bool zero = row[position] == 0;
+
+            // Short runs are swallowed by the current literal. A single zero
+            // still starts a zero run as the background is what compresses.
+            if (!zero && run < min_repeat) {
+                position += run;
+                continue;
+            }
+
+            if (literal_start < position) {
+                if (zeros > 0) PutToken(out, TOKEN_ZERO, zeros);
+                zeros = 0;
+
+                PutToken(out, TOKEN_LITERAL, position - literal_start);
+                out.insert(out.end(), row + literal_start, row + position);
+            }
+
+            if (zero) {
+                zeros += run;
+            } else {
+                if (zeros > 0) PutToken(out, TOKEN_ZERO, zeros);
+                zeros = 0;
+
+                PutToken(out, TOKEN_REPEAT, run);
+                out.push_back(row[position]);
+            }
+
+            position += run;
+            literal_start = position;
+        }
+
+        if (literal_start < width) {
+            if (zeros > 0) PutToken(out, TOKEN_ZERO, zeros);
+            zeros = 0;
+
+            PutToken(out, TOKEN_LITERAL, width - literal_start);
+            out.insert(out.end(), row + literal_start, row + width);
+        }
+    }
+
+    if (zeros > 0) PutToken(out, TOKEN_ZERO, zeros);
+}
+
+/**
+ * Runs may span several rows, so the decoded data is written in chunks which
+ * end at the row boundaries.
+ */
+bool RleDecode(
+    const uint8_t* data,
+    uint32_t length,
+    uint32_t& offset,
+    uint8_t* buffer,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride)
+{
+    uint32_t remaining = width * height,
+             x = 0;
+    uint8_t* row = buffer;
+
+    while (remaining > 0 && offset < length) {
+        uint32_t type, run;
+
+        if (!GetToken(data, length, offset, type, run)) return false;
+        if (run > remaining) return false;
+
+        const uint8_t* source = NULL;
+        uint8_t value = 0;
+
+        switch (type) {
+            case TOKEN_ZERO:
+                break;
+
+            case TOKEN_REPEAT:
+                if (offset >= length) return false;
+                value = data[offset++];
+                break;
+
+            case TOKEN_LITERAL:
+                if (run > length - offset) return false;
+                source = data + offset;
+                offset += run;
+                break;
+
+            default:
+                return false;
+        }
+
+        remaining -= run;
+
+        while (run > 0) {
+            uint32_t chunk = width - x < run ? width - x : run;
+
+            if (source != NULL) {
+                memcpy(row + x, source, chunk);
+                source += chunk;
+            } else {
+                memset(row + x, value, chunk);
+            }
+
+            run -= chunk;
+            x += chunk;
+
+            if (x == width) {
+                x = 0;
+                row += stride;
+            }
+        }
+    }
+
+    return remaining == 0;
+}
+
+}
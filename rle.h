@@ -0,0 +1,74 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_RLE_H
+#define GLOW_RLE_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace glow {
+
+/**
+ * A simple run-length encoding tailored to the mostly black surface. The
+ * encoded stream is a sequence of tokens, each starting with a varint whose
+ * lower two bits give the token type and whose remaining bits give the run
+ * length:
+ *
+ *  - zero run: the given number of zero bytes
+ *  - repeat run: followed by one byte which is repeated
+ *  - literal run: followed by the given number of bytes
+ *
+ * The encoded data is appended to out, so several planes can be encoded back
+ * to back.
+ */
+void RleEncode(
+    const uint8_t* buffer,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride,
+    std::vector<uint8_t>& out
+);
+
+/**
+ * Decode a plane of the given dimensions, starting at offset. On return,
+ * offset points past the data consumed. Returns false if the stream is
+ * malformed or ends before the plane is complete.
+ *
+ * The stream covers the rows back to back, padding is neither encoded nor
+ * touched by the decoder.
+ */
+bool RleDecode(
+    const uint8_t* data,
+    uint32_t length,
+    uint32_t& offset,
+    uint8_t* buffer,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride
+);
+
+}
+
+#endif // GLOW_RLE_H
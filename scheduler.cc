@@ -0,0 +1,419 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "scheduler.h"
+
+#include <sys/time.h>
+
+#include "ppapi/c/pp_errors.h"
+
+#include "renderer.h"
+
+#ifdef __native_client__
+#include <sys/nacl_nice.h>
+#endif
+
+namespace {
+
+/**
+ * The current time in microseconds, on the same clock as the renderers.
+ */
+int64_t Timestamp() {
+    timeval current;
+    if (gettimeofday(&current, NULL) != 0) return 0;
+
+    return static_cast<int64_t>(current.tv_sec) * 1000000 + current.tv_usec;
+}
+
+/**
+ * Change the priority of the calling thread. On NaCl, there are three
+ * levels, and realtime requires the permission of the browser. Elsewhere, the
+ * threads keep the default.
+ */
+bool SetThreadPriority(int32_t priority) {
+#ifdef __native_client__
+    int nice = NICE_NORMAL;
+
+    if (priority == glow::Settings::PRIORITY_REALTIME) nice = NICE_REALTIME;
+    if (priority == glow::Settings::PRIORITY_BACKGROUND) nice = NICE_BACKGROUND;
+
+    return nacl_thread_nice(nice) == 0;
+#else
+    return priority == glow::Settings::PRIORITY_NORMAL;
+#endif
+}
+
+}
+
+namespace glow {
+
+Worker::Worker(const pp::InstanceHandle& handle) :
+    tick_serial(0),
+    presentation_serial(0),
+    next_brush(0),
+    priority(Settings::PRIORITY_NORMAL),
+    detached(false)
+{
+    pthread_mutex_init(&detach_mutex, NULL);
+    pthread_cond_init(&detach_condition, NULL);
+
+    // The factory is created before the threads are started and destroyed
+    // after they have been joined, so no callback can outlive it.
+    callback_factory = new pp::CompletionCallbackFactory<Worker>(this);
+
+    thread = new pp::SimpleThread(handle);
+    present_thread = new pp::SimpleThread(handle);
+
+    thread->Start();
+    present_thread->Start();
+}
+
+Brush& Worker::GetBrush(float hardness) {
+    for (uint32_t i = 0; i < brush_count; i++) {
+        if (brushes[i].GetHardness() == hardness) return brushes[i];
+    }
+
+    Brush& brush(brushes[next_brush]);
+    next_brush = (next_brush + 1) % brush_count;
+
+    brush.SetHardness(hardness);
+    return brush;
+}
+
+/**
+ * All renderers have been detached at this point, so the pending ticks and
+ * flushes are simply aborted. SimpleThread::Join posts a quit message to the
+ * message loop and waits for the thread to finish.
+ */
+Worker::~Worker() {
+    thread->Join();
+    present_thread->Join();
+
+    delete thread;
+    delete present_thread;
+    delete callback_factory;
+
+    pthread_cond_destroy(&detach_condition);
+    pthread_mutex_destroy(&detach_mutex);
+}
+
+void Worker::Attach(Renderer* renderer) {
+    renderer->worker = this;
+
+    present_thread->message_loop().PostWork(callback_factory->NewCallback(
+        &Worker::DoAttachPresentation, renderer));
+    thread->message_loop().PostWork(callback_factory->NewCallback(
+        &Worker::DoAttach, renderer));
+}
+
+/**
+ * The work posted by the renderer is processed in order, so everything it
+ * has posted before has run once the detach callback has been reached. The
+ * simulation thread then forwards the detach to the presentation thread,
+ * which wakes us up.
+ */
+void Worker::Detach(Renderer* renderer) {
+    pthread_mutex_lock(&detach_mutex);
+    detached = false;
+    pthread_mutex_unlock(&detach_mutex);
+
+    thread->message_loop().PostWork(callback_factory->NewCallback(
+        &Worker::DoDetach, renderer));
+
+    pthread_mutex_lock(&detach_mutex);
+    while (!detached) pthread_cond_wait(&detach_condition, &detach_mutex);
+    pthread_mutex_unlock(&detach_mutex);
+
+    renderer->worker = NULL;
+}
+
+void Worker::DoAttach(uint32_t status, Renderer* renderer) {
+    if (status != PP_OK) return;
+
+    renderers.push_back(renderer);
+
+    // The new renderer is due right away.
+    ScheduleTick(Timestamp());
+}
+
+void Worker::DoAttachPresentation(uint32_t status, Renderer* renderer) {
+    if (status != PP_OK) return;
+
+    Presentation presentation;
+    presentation.renderer = renderer;
+    presentation.serial = ++presentation_serial;
+
+    renderer->BeginPresentation();
+    presentations.push_back(presentation);
+}
+
+/**
+ * The renderer is removed even if the callback has been aborted, as the main
+ * thread is waiting for it. An aborted loop won't run anything else, so we
+ * signal right away in that case.
+ */
+void Worker::DoDetach(uint32_t status, Renderer* renderer) {
+    for (uint32_t i = 0; i < renderers.size(); i++) {
+        if (renderers[i] == renderer) {
+            renderers.erase(renderers.begin() + i);
+            renderer->EndSimulation();
+            break;
+        }
+    }
+
+    if (status != PP_OK) {
+        SignalDetached();
+        return;
+    }
+
+    present_thread->message_loop().PostWork(callback_factory->NewCallback(
+        &Worker::DoDetachPresentation, renderer));
+}
+
+void Worker::DoDetachPresentation(uint32_t status, Renderer* renderer) {
+    for (uint32_t i = 0; i < presentations.size(); i++) {
+        if (presentations[i].renderer == renderer) {
+            presentations.erase(presentations.begin() + i);
+            break;
+        }
+    }
+
+    if (status != PP_OK) {
+        renderer->logger.Log("Presentation detach was aborted.",
+            Logger::LEVEL_WARNING);
+    }
+
+    SignalDetached();
+}
+
+void Worker::SignalDetached() {
+    pthread_mutex_lock(&detach_mutex);
+    detached = true;
+    pthread_cond_signal(&detach_condition);
+    pthread_mutex_unlock(&detach_mutex);
+}
+
+/**
+ * Supersede any pending tick with one at the given time.
+ */
+void Worker::ScheduleTick(int64_t due) {
+    int64_t delay = (due - Timestamp()) / 1000;
+
+    thread->message_loop().PostWork(
+        callback_factory->NewCallback(&Worker::Tick, ++tick_serial),
+        delay > 0 ? delay : 0
+    );
+}
+
+/**
+ * Step all renderers which are due and schedule the next tick for the
+ * earliest one. The frames published during the tick are presented in one
+ * batch.
+ */
+void Worker::Tick(uint32_t status, uint32_t serial) {
+    if (status != PP_OK || serial != tick_serial || renderers.empty()) return;
+
+    UpdatePriority();
+
+    int64_t now = Timestamp(), next = 0;
+    bool published = false;
+
+    for (uint32_t i = 0; i < renderers.size(); i++) {
+        Renderer* renderer = renderers[i];
+
+        if (renderer->GetDue() - now < tick_slack) {
+            published = renderer->Step() || published;
+        }
+
+        if (i == 0 || renderer->GetDue() < next) next = renderer->GetDue();
+    }
+
+    if (published) {
+        present_thread->message_loop().PostWork(
+            callback_factory->NewCallback(&Worker::Present));
+    }
+
+    ScheduleTick(next);
+}
+
+/**
+ * Apply the highest priority requested by the renderers to both threads. The
+ * result is logged through a renderer which requested it.
+ */
+void Worker::UpdatePriority() {
+    Renderer* requester = renderers[0];
+
+    for (uint32_t i = 1; i < renderers.size(); i++) {
+        if (renderers[i]->settings.Thread_priority() >
+            requester->settings.Thread_priority())
+        {
+            requester = renderers[i];
+        }
+    }
+
+    int32_t requested = requester->settings.Thread_priority();
+    if (requested == priority) return;
+
+    priority = requested;
+
+    if (SetThreadPriority(priority)) {
+        requester->logger.Log("Changed the priority of the rendering threads.");
+    } else {
+        requester->logger.Log("Failed to change the thread priority.",
+            Logger::LEVEL_WARNING);
+    }
+
+    present_thread->message_loop().PostWork(callback_factory->NewCallback(
+        &Worker::DoSetPresentationPriority, priority));
+}
+
+void Worker::DoSetPresentationPriority(uint32_t status, int32_t requested) {
+    if (status == PP_OK) SetThreadPriority(requested);
+}
+
+void Worker::Present(uint32_t status) {
+    if (status != PP_OK) return;
+
+    for (uint32_t i = 0; i < presentations.size(); i++) {
+        presentations[i].renderer->Present();
+    }
+}
+
+pp::CompletionCallback Worker::NewFlushCallback(Renderer* renderer) {
+    uint32_t serial = 0;
+
+    for (uint32_t i = 0; i < presentations.size(); i++) {
+        if (presentations[i].renderer == renderer) {
+            serial = presentations[i].serial;
+        }
+    }
+
+    return callback_factory->NewCallback(
+        &Worker::FlushCallback, renderer, serial);
+}
+
+void Worker::FlushCallback(
+    uint32_t status,
+    Renderer* renderer,
+    uint32_t serial)
+{
+    for (uint32_t i = 0; i < presentations.size(); i++) {
+        if (presentations[i].renderer == renderer &&
+            presentations[i].serial == serial)
+        {
+            renderer->RenderCallback(status);
+            return;
+        }
+    }
+}
+
+Scheduler::Scheduler() :
+    owner(0)
+{}
+
+Scheduler::~Scheduler() {
+    StopWorkers();
+}
+
+void Scheduler::Attach(
+    Renderer* renderer,
+    const pp::InstanceHandle& handle,
+    uint32_t pixels)
+{
+    if (workers.empty()) StartWorkers(handle.pp_instance());
+
+    Entry entry;
+    entry.renderer = renderer;
+    entry.instance = handle.pp_instance();
+    entry.pixels = pixels;
+
+    Assign(entry);
+    entries.push_back(entry);
+}
+
+void Scheduler::Detach(Renderer* renderer) {
+    uint32_t index = entries.size();
+
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        if (entries[i].renderer == renderer) index = i;
+    }
+    if (index == entries.size()) return;
+
+    Entry entry = entries[index];
+
+    workers[entry.worker]->Detach(renderer);
+    worker_pixels[entry.worker] -= entry.pixels;
+    entries.erase(entries.begin() + index);
+
+    if (entries.empty()) {
+        StopWorkers();
+        return;
+    }
+
+    if (entry.instance != owner) return;
+
+    // The message loops of the workers belong to the departing instance, so
+    // we move the remaining renderers to a fresh set of workers. Work which
+    // is still pending in the old loops is aborted.
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        workers[entries[i].worker]->Detach(entries[i].renderer);
+    }
+
+    StopWorkers();
+    StartWorkers(entries[0].instance);
+
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        Assign(entries[i]);
+    }
+}
+
+void Scheduler::Assign(Entry& entry) {
+    entry.worker = 0;
+
+    for (uint32_t i = 1; i < workers.size(); i++) {
+        if (worker_pixels[i] < worker_pixels[entry.worker]) entry.worker = i;
+    }
+
+    worker_pixels[entry.worker] += entry.pixels;
+    workers[entry.worker]->Attach(entry.renderer);
+}
+
+void Scheduler::StartWorkers(PP_Instance instance) {
+    owner = instance;
+
+    for (uint32_t i = 0; i < worker_count; i++) {
+        workers.push_back(new Worker(pp::InstanceHandle(instance)));
+        worker_pixels.push_back(0);
+    }
+}
+
+void Scheduler::StopWorkers() {
+    for (uint32_t i = 0; i < workers.size(); i++) delete workers[i];
+
+    workers.clear();
+    worker_pixels.clear();
+    owner = 0;
+}
+
+}
@@ -0,0 +1,230 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_SCHEDULER_H
+#define GLOW_SCHEDULER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <pthread.h>
+
+#include "ppapi/c/pp_instance.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/cpp/message_loop.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/utility/threading/simple_thread.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+#include "brush.h"
+
+namespace glow {
+
+class Renderer;
+
+/**
+ * A worker drives a group of renderers from two threads. The simulation
+ * thread steps all renderers which are due on a common tick, so renderers
+ * with the same target FPS are processed in one go. The presentation thread
+ * then converts and flushes the frames published during the tick in a single
+ * batch.
+ *
+ * Both threads just run their message loops: the tick is a delayed callback
+ * which reposts itself, and the work posted by the renderers runs in between
+ * ticks.
+ *
+ * Both threads run at the highest priority requested by the settings of the
+ * attached renderers. NaCl only allows a thread to change its own priority,
+ * and doesn't expose CPU affinity at all.
+ */
+class Worker {
+    public:
+
+        explicit Worker(const pp::InstanceHandle& handle);
+        ~Worker();
+
+        /**
+         * Called from the main thread. Detach blocks until the renderer has
+         * been removed from both threads; the worker won't touch it again
+         * afterwards.
+         */
+        void Attach(Renderer* renderer);
+        void Detach(Renderer* renderer);
+
+        /**
+         * Renderers post their work to the simulation thread.
+         */
+        pp::MessageLoop& GetMessageLoop() {
+            return thread->message_loop();
+        }
+
+        /**
+         * The brush kernels are shared by all renderers of the worker. Only
+         * to be used on the simulation thread.
+         */
+        Brush& GetBrush(float hardness);
+
+        /**
+         * The flush completion callback for a renderer. Only to be used on
+         * the presentation thread.
+         */
+        pp::CompletionCallback NewFlushCallback(Renderer* renderer);
+
+    private:
+
+        /**
+         * Renderers which are due within this many microseconds are stepped
+         * right away, as the tick is only scheduled with millisecond
+         * resolution.
+         */
+        static const int64_t tick_slack = 1000;
+
+        pp::SimpleThread* thread;
+        pp::SimpleThread* present_thread;
+
+        /**
+         * pp::CompletionCallbackFactory allows to create
+         * pp::CompletionCallback instances from instance methods. The worker
+         * outlives all its renderers, so callbacks which may arrive after a
+         * renderer has been detached are routed through the worker.
+         */
+        pp::CompletionCallbackFactory<Worker>* callback_factory;
+
+        /**
+         * Owned by the simulation thread. Only the most recently scheduled
+         * tick is run, older ones are discarded by comparing the serial.
+         */
+        std::vector<Renderer*> renderers;
+        uint32_t tick_serial;
+
+        /**
+         * Owned by the presentation thread. The serial identifies the
+         * attachment, so flushes issued for a detached renderer are ignored
+         * even if another one has been allocated at the same address.
+         */
+        struct Presentation {
+            Renderer* renderer;
+            uint32_t serial;
+        };
+
+        std::vector<Presentation> presentations;
+        uint32_t presentation_serial;
+
+        /**
+         * Changing the hardness drops all kernels of a brush, so we keep a
+         * few brushes around for renderers with different hardness and
+         * recycle them in turn.
+         */
+        static const uint32_t brush_count = 4;
+        Brush brushes[brush_count];
+        uint32_t next_brush;
+
+        /**
+         * The priority last applied to the threads, owned by the simulation
+         * thread. A failed change is not retried until the requested
+         * priority changes again.
+         */
+        int32_t priority;
+
+        /**
+         * Raised by the worker threads once a detach has completed. The
+         * main thread waits on the condition.
+         */
+        pthread_mutex_t detach_mutex;
+        pthread_cond_t detach_condition;
+        bool detached;
+
+        void DoAttach(uint32_t status, Renderer* renderer);
+        void DoAttachPresentation(uint32_t status, Renderer* renderer);
+        void DoDetach(uint32_t status, Renderer* renderer);
+        void DoDetachPresentation(uint32_t status, Renderer* renderer);
+        void SignalDetached();
+
+        void UpdatePriority();
+        void DoSetPresentationPriority(uint32_t status, int32_t requested);
+
+        void ScheduleTick(int64_t due);
+        void Tick(uint32_t status, uint32_t serial);
+        void Present(uint32_t status);
+        void FlushCallback(uint32_t status, Renderer* renderer, uint32_t serial);
+
+        Worker(const Worker&);
+        const Worker& operator=(const Worker&);
+};
+
+/**
+ * The scheduler distributes the renderers of all instances on the page over
+ * a fixed pool of workers, so the number of threads doesn't grow with the
+ * number of instances. A renderer is assigned to the worker with the least
+ * pixels, which keeps the load balanced by area.
+ *
+ * All methods are called from the main thread. The worker threads are
+ * started with the first renderer and stopped with the last one. As their
+ * message loops belong to the instance which started them, the workers are
+ * restarted under another instance if that one goes away first.
+ */
+class Scheduler {
+    public:
+
+        Scheduler();
+        ~Scheduler();
+
+        /**
+         * Attach a renderer with the given number of pixels to one of the
+         * workers. Detach blocks until the worker has let go of it.
+         */
+        void Attach(
+            Renderer* renderer,
+            const pp::InstanceHandle& handle,
+            uint32_t pixels
+        );
+        void Detach(Renderer* renderer);
+
+    private:
+
+        static const uint32_t worker_count = 2;
+
+        struct Entry {
+            Renderer* renderer;
+            PP_Instance instance;
+            uint32_t pixels;
+            uint32_t worker;
+        };
+
+        std::vector<Entry> entries;
+        std::vector<Worker*> workers;
+        std::vector<uint32_t> worker_pixels;
+        PP_Instance owner;
+
+        void Assign(Entry& entry);
+        void StartWorkers(PP_Instance instance);
+        void StopWorkers();
+
+        Scheduler(const Scheduler&);
+        const Scheduler& operator=(const Scheduler&);
+};
+
+}
+
+#endif // GLOW_SCHEDULER_H
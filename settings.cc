@@ -43,37 +43,187 @@ template<typename T> T constrain(T value, T min, T max) {
 namespace glow {
 
 Settings::Settings() :
-    bleed(0.8),
-    decay_lin(1),
+    layers(1),
+    layer(0),
+    color(false),
     fps(20),
-    radius(5)
+    radius(5),
+    brush_hardness(0.5),
+    brush_intensity(255),
+    brush_color(0xFFFFFF),
+    broadcast_interval(250),
+    throttle(true),
+    frame_interval(100),
+    frame_downsample(4),
+    thread_priority(PRIORITY_NORMAL),
+    version(0)
 {
-    Decay_exp(10.);
+    for (uint32_t i = 0; i < max_layers; i++) {
+        Layer_bleed(i, 0.8);
+        Layer_decay_exp(i, 10.);
+        Layer_decay_lin(i, 1);
+    }
 }
 
-Settings& Settings::Bleed(float _bleed) {
-    bleed = constrain(_bleed, 0.f, 1.f);
+Settings::Settings(const Settings& settings) :
+    version(settings.Version())
+{
+    CopyValues(settings);
+}
+
+Settings& Settings::operator=(const Settings& settings) {
+    CopyValues(settings);
+
+    Touch();
     return *this;
 }
 
-Settings& Settings::Decay_exp(float _decay_exp) {
-    decay_exp = constrain(_decay_exp, 0.f, 15.f);
-    decay_factor = decay_exp == 0 ? 0 : powf(0.5, (15. - decay_exp));
+void Settings::CopyValues(const Settings& settings) {
+    layers = settings.layers;
+    layer = settings.layer;
+    color = settings.color;
+    fps = settings.fps;
+    radius = settings.radius;
+    brush_hardness = settings.brush_hardness;
+    brush_intensity = settings.brush_intensity;
+    brush_color = settings.brush_color;
+    broadcast_interval = settings.broadcast_interval;
+    throttle = settings.throttle;
+    frame_interval = settings.frame_interval;
+    frame_downsample = settings.frame_downsample;
+    thread_priority = settings.thread_priority;
+
+    for (uint32_t i = 0; i < max_layers; i++) {
+        bleed[i] = settings.bleed[i];
+        decay_lin[i] = settings.decay_lin[i];
+        decay_exp[i] = settings.decay_exp[i];
+        decay_factor[i] = settings.decay_factor[i];
+    }
+}
+
+Settings& Settings::Layers(uint32_t _layers) {
+    layers = color ? 3 : constrain<uint32_t>(_layers, 1, max_layers);
+    if (layer >= layers) layer = layers - 1;
+    Touch();
     return *this;
 }
 
-Settings& Settings::Decay_lin(uint8_t _decay_lin) {
-    decay_lin = _decay_lin;
+/**
+ * By default, red decays slowest and blue fastest, so white fades through
+ * yellow and orange to red.
+ */
+Settings& Settings::Color(bool _color) {
+    color = _color;
+
+    if (color) {
+        Layers(3);
+        Layer_decay_exp(0, 10.);
+        Layer_decay_exp(1, 9.5);
+        Layer_decay_exp(2, 8.5);
+    }
+
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Layer(uint32_t _layer) {
+    layer = constrain<uint32_t>(_layer, 0, layers - 1);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Layer_bleed(uint32_t layer, float _bleed) {
+    if (layer < max_layers) bleed[layer] = constrain(_bleed, 0.f, 1.f);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Layer_decay_exp(uint32_t layer, float _decay_exp) {
+    if (layer < max_layers) {
+        decay_exp[layer] = constrain(_decay_exp, 0.f, 15.f);
+        decay_factor[layer] = decay_exp[layer] == 0 ?
+            0 : powf(0.5, (15. - decay_exp[layer]));
+    }
+    Touch();
     return *this;
 }
 
+Settings& Settings::Layer_decay_lin(uint32_t layer, uint8_t _decay_lin) {
+    if (layer < max_layers) decay_lin[layer] = _decay_lin;
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Bleed(float _bleed) {
+    return Layer_bleed(layer, _bleed);
+}
+
+Settings& Settings::Decay_exp(float _decay_exp) {
+    return Layer_decay_exp(layer, _decay_exp);
+}
+
+Settings& Settings::Decay_lin(uint8_t _decay_lin) {
+    return Layer_decay_lin(layer, _decay_lin);
+}
+
 Settings& Settings::Radius(uint32_t _radius) {
-    radius = _radius;
+    radius = constrain<uint32_t>(_radius, 0, max_radius);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Brush_hardness(float _brush_hardness) {
+    brush_hardness = constrain(_brush_hardness, 0.f, 1.f);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Brush_intensity(uint8_t _brush_intensity) {
+    brush_intensity = _brush_intensity;
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Brush_color(uint32_t _brush_color) {
+    brush_color = _brush_color & 0xFFFFFF;
+    Touch();
     return *this;
 }
 
 Settings& Settings::Fps(uint8_t _fps) {
     fps = _fps;
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Broadcast_interval(uint32_t _broadcast_interval) {
+    broadcast_interval = constrain<uint32_t>(_broadcast_interval, 16, 10000);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Throttle(bool _throttle) {
+    throttle = _throttle;
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Frame_interval(uint32_t _frame_interval) {
+    frame_interval = constrain<uint32_t>(_frame_interval, 0, 60000);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Frame_downsample(uint32_t _frame_downsample) {
+    frame_downsample = constrain<uint32_t>(_frame_downsample, 1, 16);
+    Touch();
+    return *this;
+}
+
+Settings& Settings::Thread_priority(int32_t _thread_priority) {
+    thread_priority = constrain<int32_t>(_thread_priority,
+        PRIORITY_BACKGROUND, PRIORITY_REALTIME);
+    Touch();
     return *this;
 }
 
@@ -36,14 +36,78 @@ namespace glow {
  * marked as volatile in order to ensure that no values are cached in
  * registers. As any race between getters and setters is not harmful to the
  * program logic, we don't need to use mutexes to ensure exclusive access.
+ *
+ * Bleed and decay are kept separately for each layer. The plain accessors
+ * refer to the active layer, which is also the layer pointer input is drawn
+ * to.
+ *
+ * Each setter bumps the version, so the renderer can cache state derived
+ * from the settings and only rebuild it after a change.
  */
 class Settings {
     public:
 
+        static const uint32_t max_layers = 4;
+
+        /**
+         * The largest brush radius, see Brush::max_radius.
+         */
+        static const uint32_t max_radius = 255;
+
         Settings();
 
+        /**
+         * A copy starts with the version of the original. Assignment copies
+         * the values only and then bumps the version of the target, see
+         * Touch.
+         */
+        Settings(const Settings& settings);
+        Settings& operator=(const Settings& settings);
+
+        /**
+         * The number of layers is fixed when the renderer starts.
+         */
+        uint32_t Layers() const volatile {
+            return layers;
+        }
+        Settings& Layers(uint32_t layers);
+
+        /**
+         * In color mode, the surface is RGB with one layer per channel, and
+         * pointer input is drawn to all of them in the brush color. Like the
+         * number of layers, this is fixed when the renderer starts.
+         */
+        bool Color() const volatile {
+            return color;
+        }
+        Settings& Color(bool color);
+
+        uint32_t Layer() const volatile {
+            return layer;
+        }
+        Settings& Layer(uint32_t layer);
+
+        float Layer_bleed(uint32_t layer) const volatile {
+            return bleed[layer];
+        }
+        Settings& Layer_bleed(uint32_t layer, float bleed);
+
+        float Layer_decay_exp(uint32_t layer) const volatile {
+            return decay_exp[layer];
+        }
+        Settings& Layer_decay_exp(uint32_t layer, float decay_exp);
+
+        float Layer_decay_factor(uint32_t layer) const volatile {
+            return decay_factor[layer];
+        }
+
+        uint8_t Layer_decay_lin(uint32_t layer) const volatile {
+            return decay_lin[layer];
+        }
+        Settings& Layer_decay_lin(uint32_t layer, uint8_t decay_lin);
+
         float Bleed() const volatile {
-            return bleed;
+            return bleed[layer];
         }
         Settings& Bleed(float bleed);
 
@@ -53,7 +117,7 @@ class Settings {
          * factor is calculated from this on the fly.
          */
         float Decay_exp() const volatile {
-            return decay_exp;
+            return decay_exp[layer];
         }
         Settings& Decay_exp(float decay_exp);
 
@@ -61,11 +125,11 @@ class Settings {
          * See above.
          */
         float Decay_factor() const volatile {
-            return decay_factor;
+            return decay_factor[layer];
         }
 
         uint8_t Decay_lin() const volatile {
-            return decay_lin;
+            return decay_lin[layer];
         }
         Settings& Decay_lin(uint8_t decay_lin);
 
@@ -74,18 +138,120 @@ class Settings {
         }
         Settings& Radius(uint32_t radius);
 
+        /**
+         * Brush hardness (0 - 1) and intensity used for mouse and touch
+         * input.
+         */
+        float Brush_hardness() const volatile {
+            return brush_hardness;
+        }
+        Settings& Brush_hardness(float brush_hardness);
+
+        uint8_t Brush_intensity() const volatile {
+            return brush_intensity;
+        }
+        Settings& Brush_intensity(uint8_t brush_intensity);
+
+        /**
+         * The brush color as 0xRRGGBB, only used in color mode.
+         */
+        uint32_t Brush_color() const volatile {
+            return brush_color;
+        }
+        Settings& Brush_color(uint32_t brush_color);
+
         uint8_t Fps() const volatile {
             return fps;
         }
         Settings& Fps(uint8_t fps);
 
+        /**
+         * The interval in milliseconds at which telemetry is sent to JS.
+         */
+        uint32_t Broadcast_interval() const volatile {
+            return broadcast_interval;
+        }
+        Settings& Broadcast_interval(uint32_t broadcast_interval);
+
+        /**
+         * If throttling is off, the rendering loop runs as fast as it can
+         * and each iteration counts as one frame at the target FPS.
+         */
+        bool Throttle() const volatile {
+            return throttle;
+        }
+        Settings& Throttle(bool throttle);
+
+        /**
+         * Headless mode delivers a frame every frame interval milliseconds,
+         * downsampled by the given factor along each axis.
+         */
+        uint32_t Frame_interval() const volatile {
+            return frame_interval;
+        }
+        Settings& Frame_interval(uint32_t frame_interval);
+
+        uint32_t Frame_downsample() const volatile {
+            return frame_downsample;
+        }
+        Settings& Frame_downsample(uint32_t frame_downsample);
+
+        /**
+         * The priority requested for the rendering threads. The threads are
+         * shared between instances, so the highest request wins (see
+         * Worker). Realtime priority needs the permission of the browser.
+         */
+        enum Priority {
+            PRIORITY_BACKGROUND = -1,
+            PRIORITY_NORMAL = 0,
+            PRIORITY_REALTIME = 1
+        };
+
+        int32_t Thread_priority() const volatile {
+            return thread_priority;
+        }
+        Settings& Thread_priority(int32_t thread_priority);
+
+        /**
+         * The barrier pairs with the one in Touch: values read after the
+         * version are at least as new as the version.
+         */
+        uint32_t Version() const volatile {
+            uint32_t current = version;
+            __sync_synchronize();
+            return current;
+        }
+
     private:
         
-        float bleed;
-        uint8_t decay_lin, fps;
+        uint32_t layers, layer;
+        bool color;
+        float bleed[max_layers];
+        uint8_t decay_lin[max_layers];
+        uint8_t fps;
         uint32_t radius;
+        float brush_hardness;
+        uint8_t brush_intensity;
+        uint32_t brush_color;
+        uint32_t broadcast_interval;
+        bool throttle;
+        uint32_t frame_interval, frame_downsample;
+        int32_t thread_priority;
+
+        float decay_exp[max_layers], decay_factor[max_layers];
+
+        /**
+         * Bumped with a full barrier after the new values have been stored
+         * by a setter or an assignment, so a reader which sees the new
+         * version also sees the values. Assignment doesn't copy it.
+         */
+        uint32_t version;
+
+        void Touch() {
+            __sync_fetch_and_add(&version, 1);
+        }
 
-        float decay_exp, decay_factor;
+        void CopyValues(const Settings& settings);
 };
 
 }
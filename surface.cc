@@ -27,102 +27,596 @@
 #include <cstring>
 #include <cmath>
 
+namespace {
+
+// We use integer arithmetics in order to steer clear of potential
+// performance hits on ARM. In order to increase numeric accuracy, the
+// 8-bit grayscale values are mapped to 32 bits by multiplication /
+// division. This factor is chosen to maximize precision while avoiding
+// overflows.
+const uint32_t base = 1 << 20;
+
+}
+
 namespace glow {
 
-Surface::Surface(uint32_t width, uint32_t height) :
+Surface::Surface(
+    uint32_t width,
+    uint32_t height,
+    uint32_t layers,
+    bool interleaved
+) :
     width(width),
     height(height),
-    area(width * height)
+    area(width * height),
+    channels(interleaved ? interleaved_channels : 1),
+    stride(StrideForWidth(width, channels)),
+    layers(layers == 0 ? 1 :
+        (interleaved && layers > interleaved_channels ?
+            interleaved_channels : layers)),
+    planes(interleaved ? 2 : 2 * this->layers),
+    front(0),
+    selected(0),
+    columns(stride),
+    layer_decay(interleaved ? channels : this->layers),
+    pipeline(NULL)
 {
-    buffer = new uint8_t[area];
-    backbuffer = new uint8_t[area];
-    memset(buffer, 0, area);
+    // Each plane is framed by guard rows above and below. The stencils also
+    // read left of the upper guard rows, so the plane is preceded by another
+    // aligned block.
+    uint32_t plane_size = alignment + (height + 2 * guard) * stride,
+             plane_offset = plane_size + plane_stagger,
+             arena_size = planes.size() * plane_offset + alignment - 1;
+
+    // operator new doesn't guarantee the alignment, so we align manually.
+    arena = new uint8_t[arena_size];
+    memset(arena, 0, arena_size);
+
+    uint8_t* base = arena + (alignment -
+        reinterpret_cast<uintptr_t>(arena) % alignment) % alignment;
+
+    for (uint32_t i = 0; i < planes.size(); i++) {
+        planes[i] = base + i * plane_offset + alignment + guard * stride;
+    }
+
+    buffer = planes[0];
+
+    // The pipeline has one buffer for each step but the last.
+    pipeline_steps = pipeline_budget / ((pipeline_rows + 1) * stride) + 1;
+    if (pipeline_steps > max_pipeline_steps) {
+        pipeline_steps = max_pipeline_steps;
+    }
+
+    if (pipeline_steps > 1) {
+        pipeline_arena.resize(
+            (pipeline_steps - 1) * (pipeline_rows + 1) * stride +
+                alignment - 1,
+            0
+        );
+
+        pipeline = &pipeline_arena[0] + (alignment -
+            reinterpret_cast<uintptr_t>(&pipeline_arena[0]) % alignment) %
+                alignment;
+    }
 }
 
 Surface::~Surface() {
-    delete[] buffer;
-    delete[] backbuffer;
+    delete[] arena;
 }
 
-void Surface::Decay(float bleed, float decay_exp, uint8_t decay_lin) {
-    // We use integer arithmetics in order to steer clear of potential
-    // performance hits on ARM. In order to increase numeric accuracy, the
-    // 8-bit grayscale values are mapped to 32 bits by multiplication /
-    // division. This factor is chosen to maximize precision while avoiding
-    // overflows.
-    const uint32_t base = 1 << 20;
+uint32_t Surface::StrideForWidth(uint32_t width, uint32_t channels) {
+    // The padding at the end of a row holds the right guard columns of this
+    // row and the left guard columns of the next one.
+    return ((width + 2 * guard) * channels + alignment - 1) & ~(alignment - 1);
+}
+
+void Surface::Clear() {
+    for (uint32_t i = 0; i < GetPlanes(); i++) {
+        memset(GetBuffer(i), 0, height * stride);
+    }
+}
+
+void Surface::Decay(
+    const DecayParameters* parameters,
+    uint32_t steps,
+    bool exact)
+{
+    if (steps == 0) return;
+
+    ApplyDecay(steps, PrepareLayers(parameters, steps, exact, layer_decay));
+}
 
-    int32_t     bleed_neightbours = nearbyint(bleed / 8. * static_cast<float>(base)),
-                bleed_center = nearbyint((1. - bleed) * static_cast<float>(base)),
-                decay_factor = nearbyint((1. - decay_exp) * static_cast<float>(base));
+void Surface::PrepareDecay(
+    const DecayParameters* parameters,
+    uint32_t steps,
+    bool exact,
+    DecayPlan& plan) const
+{
+    plan.steps = steps;
+    plan.pipelined = PrepareLayers(parameters, steps, exact, plan.layers);
+}
+
+void Surface::Decay(const DecayPlan& plan) {
+    if (plan.steps == 0) return;
+
+    layer_decay = plan.layers;
+    ApplyDecay(plan.steps, plan.pipelined);
+}
+
+/**
+ * Prepare one LayerDecay per layer or, if interleaved, per channel, and
+ * return whether the steps are applied one by one.
+ */
+bool Surface::PrepareLayers(
+    const DecayParameters* parameters,
+    uint32_t steps,
+    bool exact,
+    std::vector<LayerDecay>& decay) const
+{
+    // Within the reach of the pipeline, the steps are applied one by one.
+    bool pipelined = steps == 1 || (exact && steps <= pipeline_steps);
+
+    decay.resize(layer_decay.size());
+
+    for (uint32_t i = 0; i < layers; i++) {
+        PrepareLayer(parameters[i], pipelined ? 1 : steps, decay[i]);
+    }
+
+    if (channels > 1) {
+        // Channels without a layer are kept blank.
+        LayerDecay blank = LayerDecay();
+        for (uint32_t c = layers; c < channels; c++) decay[c] = blank;
+
+        // The channels of the interleaved plane share the method.
+        bool separable = false;
+        for (uint32_t c = 0; c < layers; c++) {
+            separable = separable || decay[c].separable;
+        }
+        for (uint32_t c = 0; c < channels; c++) {
+            decay[c].separable = separable;
+        }
+    }
+
+    return pipelined;
+}
+
+/**
+ * The layers are processed row by row, so the loop over the surface is shared
+ * and each layer only adds the cost of its own stencil.
+ */
+void Surface::ApplyDecay(uint32_t steps, bool pipelined) {
+    uint32_t back = front ^ 1;
 
-    for (uint32_t x = 0; x < width; x++) {
+    if (pipelined && steps > 1) {
+        for (uint32_t i = 0; i < GetPlanes(); i++) DecayPipeline(i, steps);
+    } else {
         for (uint32_t y = 0; y < height; y++) {
-            int32_t hue = 0;
-            
-            if (bleed_neightbours > 0) {
-                    hue += bleed_neightbours * (
-                        GetClipped(x-1, y-1) + GetClipped(x, y-1) + GetClipped(x+1, y-1) +
-                        GetClipped(x-1, y) + GetClipped(x+1, y) +
-                        GetClipped(x-1, y+1) + GetClipped(x, y+1) + GetClipped(x+1, y+1)
-                    );
-                hue += bleed_center * Get(x, y);
-                hue /= base;
-            } else {
-                hue = Get(x, y);
+            uint32_t offset = y * stride;
+
+            for (uint32_t i = 0; i < GetPlanes(); i++) {
+                DecayRow(i,
+                    planes[2 * i + front] + offset,
+                    planes[2 * i + back] + offset
+                );
             }
-            hue *= decay_factor;
-            hue /= base;
-            hue -= decay_lin;
+        }
+    }
+
+    front = back;
+    buffer = LayerBuffer(selected);
+}
+
+void Surface::DecayRow(uint32_t plane, const uint8_t* row, uint8_t* target) {
+    const LayerDecay& decay(layer_decay[plane]);
+
+    if (channels > 1) {
+        if (decay.separable) {
+            DecayInterleavedSeparable(row, target);
+        } else {
+            DecayInterleavedStencil(row, target);
+        }
+    } else if (decay.separable) {
+        DecaySeparable(row, target, decay);
+    } else {
+        DecayStencil(row, target, decay);
+    }
+}
+
+/**
+ * Apply several steps in a single sweep over a plane. Step s trails the
+ * first one by s * radius rows, so it only reads the most recent rows of the
+ * previous step. The intermediate states are kept in a small buffer each and
+ * never leave the cache, only the current and the next plane are streamed
+ * through memory. If a buffer is full, the rows which are still needed are
+ * moved to its start.
+ *
+ * The rows above and below the surface are blank in every state, just like
+ * the guard rows of the planes. The results are the same as for single steps.
+ */
+void Surface::DecayPipeline(uint32_t plane, uint32_t steps) {
+    const uint8_t* source = planes[2 * plane + front];
+    uint8_t* target = planes[2 * plane + (front ^ 1)];
+
+    int32_t radius = layer_decay[plane].separable ? guard : 1,
+            keep = 2 * radius,
+            rows = height,
+            row_size = width * channels,
+            buffer_size = (pipeline_rows + 1) * stride;
+
+    // The first row of buffer s holds row first[s] of state s + 1.
+    int32_t first[max_pipeline_steps];
+
+    for (uint32_t s = 0; s + 1 < steps; s++) {
+        first[s] = -radius;
+        memset(pipeline + s * buffer_size + stride, 0, radius * stride);
+    }
+
+    int32_t last = rows + (steps - 1) * radius;
 
-            uint32_t offset = y * width + x;
-            if (hue < 0) {
-                backbuffer[offset] = 0;
-            } else if (hue > 255) {
-                backbuffer[offset] = 255;
+    for (int32_t t = 0; t < last; t++) {
+        for (uint32_t s = 0; s < steps; s++) {
+            int32_t y = t - s * radius;
+            if (y < 0) break;
+
+            // The final step goes to the plane, the others only need to
+            // cover the rows read by the next one.
+            bool to_plane = s + 1 == steps;
+            if (y >= rows + (to_plane ? 0 : radius)) continue;
+
+            uint8_t* output;
+
+            if (to_plane) {
+                output = target + y * stride;
             } else {
-                backbuffer[offset] = hue;
+                uint8_t* buffer = pipeline + s * buffer_size + stride;
+
+                if (y - first[s] == static_cast<int32_t>(pipeline_rows)) {
+                    memcpy(buffer,
+                        buffer + (pipeline_rows - keep) * stride,
+                        keep * stride
+                    );
+                    first[s] += pipeline_rows - keep;
+                }
+
+                output = buffer + (y - first[s]) * stride;
+
+                if (y >= rows) {
+                    memset(output, 0, row_size);
+                    continue;
+                }
             }
+
+            const uint8_t* row = s == 0 ? source + y * stride :
+                pipeline + (s - 1) * buffer_size + stride +
+                    (y - first[s - 1]) * stride;
+
+            DecayRow(plane, row, output);
+        }
+    }
+}
+
+/**
+ * A single step always uses the regular stencil. Advancing by several steps
+ * composes the exponential and linear decay. A single bleed step moves a
+ * fraction of 3/4 * bleed of each pixel by one pixel along each axis, so the
+ * variance grows by that amount per step. For a small combined bleed, the
+ * regular stencil with the combined bleed has the same variance and a
+ * similar shape; beyond that we switch to a separable Gaussian of the same
+ * variance, truncated at the guard width.
+ */
+void Surface::PrepareLayer(
+    const DecayParameters& parameters,
+    uint32_t steps,
+    LayerDecay& decay) const
+{
+    // The factor stays in double precision, like in the single step code
+    // before, so a single step is exact.
+    double factor = 1. - parameters.decay_exp;
+
+    if (steps == 1) {
+        decay.decay_factor = nearbyint(factor * static_cast<float>(base));
+        decay.decay_lin = parameters.decay_lin;
+    } else {
+        // v -> v * f - l repeated n times is v * f^n - l * (1 - f^n) / (1 - f)
+        double factor_steps = pow(factor, static_cast<double>(steps)),
+               lin = factor < 1 ?
+                 parameters.decay_lin * (1. - factor_steps) / (1. - factor) :
+                 static_cast<double>(parameters.decay_lin) * steps;
+
+        decay.decay_factor = nearbyint(factor_steps * static_cast<float>(base));
+        decay.decay_lin = nearbyint(lin);
+    }
+
+    float bleed = parameters.bleed * steps;
+    decay.separable = steps > 1 && bleed > .5;
+
+    decay.bleed_neighbours = nearbyint(bleed / 8. * static_cast<float>(base));
+    decay.bleed_center = nearbyint((1. - bleed) * static_cast<float>(base));
+
+    // The kernel is applied in two passes, so its weights use half the bits
+    // of the base.
+    const int32_t kernel_base = 1 << 10;
+
+    float variance = .75 * bleed,
+          weights[guard + 1],
+          sum = 1;
+
+    for (int32_t i = 1; i <= static_cast<int32_t>(guard); i++) {
+        // Below the stencil threshold (only used if an interleaved channel
+        // needs the separable kernel), a three tap kernel of the same
+        // variance is a closer match than the sampled Gaussian.
+        if (decay.separable) {
+            weights[i] = expf(-(i * i) / (2 * variance));
+        } else {
+            weights[i] = i == 1 ? variance / (2. - 2. * variance) : 0;
+        }
+        sum += 2 * weights[i];
+    }
+
+    // The center takes what is left, so the weights add up exactly.
+    decay.kernel[0] = kernel_base;
+
+    for (uint32_t i = 1; i <= guard; i++) {
+        decay.kernel[i] = nearbyint(weights[i] / sum * kernel_base);
+        decay.kernel[0] -= 2 * decay.kernel[i];
+    }
+}
+
+void Surface::DecayStencil(
+    const uint8_t* row,
+    uint8_t* target,
+    const LayerDecay& decay)
+{
+    // The rows above and below the surface and the padding to the left and
+    // right are blank, so neighbours can be read without clipping.
+    const uint8_t* above = row - stride;
+    const uint8_t* below = row + stride;
+
+    int32_t     bleed_neightbours = decay.bleed_neighbours,
+                bleed_center = decay.bleed_center,
+                decay_factor = decay.decay_factor,
+                decay_lin = decay.decay_lin;
+
+    // The index is signed, as we read one pixel to the left of the row.
+    for (int32_t x = 0; x < static_cast<int32_t>(width); x++) {
+        int32_t hue = 0;
+
+        if (bleed_neightbours > 0) {
+                hue += bleed_neightbours * (
+                    above[x-1] + above[x] + above[x+1] +
+                    row[x-1] + row[x+1] +
+                    below[x-1] + below[x] + below[x+1]
+                );
+            hue += bleed_center * row[x];
+            hue /= base;
+        } else {
+            hue = row[x];
+        }
+        hue *= decay_factor;
+        hue /= base;
+        hue -= decay_lin;
+
+        if (hue < 0) {
+            target[x] = 0;
+        } else if (hue > 255) {
+            target[x] = 255;
+        } else {
+            target[x] = hue;
         }
     }
+}
+
+void Surface::DecaySeparable(
+    const uint8_t* row,
+    uint8_t* target,
+    const LayerDecay& decay)
+{
+    const int32_t radius = guard;
+    const int32_t* kernel = decay.kernel;
+
+    int32_t* column = &columns[guard];
+    int32_t pitch = stride;
+
+    // Vertical pass, including the columns the horizontal pass reads beyond
+    // the edges. All taps of a column are summed in one go, so the column
+    // buffer is written only once.
+    int32_t first = -radius,
+            last = static_cast<int32_t>(width) + radius;
+
+    for (int32_t x = first; x < last; x++) {
+        int32_t sum = kernel[0] * row[x];
+
+        for (int32_t k = 1; k <= radius; k++) {
+            sum += kernel[k] * (row[x - k * pitch] + row[x + k * pitch]);
+        }
+
+        column[x] = sum;
+    }
+
+    for (int32_t x = 0; x < static_cast<int32_t>(width); x++) {
+        int32_t hue = kernel[0] * column[x];
+
+        for (int32_t k = 1; k <= radius; k++) {
+            hue += kernel[k] * (column[x - k] + column[x + k]);
+        }
+
+        hue /= base;
+        hue *= decay.decay_factor;
+        hue /= base;
+        hue -= decay.decay_lin;
+
+        if (hue < 0) {
+            target[x] = 0;
+        } else if (hue > 255) {
+            target[x] = 255;
+        } else {
+            target[x] = hue;
+        }
+    }
+}
+
+/**
+ * The interleaved variants follow the grayscale ones, with neighbours one
+ * pixel (four bytes) apart. The parameters are gathered into one small array
+ * per coefficient and the channels of a pixel are processed by a fixed size
+ * inner loop, which the compiler can map to vector lanes.
+ */
+void Surface::DecayInterleavedStencil(const uint8_t* row, uint8_t* target) {
+    const int32_t n = interleaved_channels;
+
+    // The coefficients are repeated to fill a block of several pixels, so
+    // the inner loop has a fixed length the compiler can map to vector
+    // registers.
+    const int32_t block = 4 * n;
+
+    const uint8_t* above = row - stride;
+    const uint8_t* below = row + stride;
+
+    int32_t bleed_neighbours[block], bleed_center[block],
+            decay_factor[block], decay_lin[block];
+
+    for (int32_t j = 0; j < block; j++) {
+        const LayerDecay& decay(layer_decay[j % n]);
+
+        bleed_neighbours[j] = decay.bleed_neighbours;
+        bleed_center[j] = decay.bleed_center;
+        decay_factor[j] = decay.decay_factor;
+        decay_lin[j] = decay.decay_lin;
+    }
+
+    int32_t size = width * n;
+
+    for (int32_t x = 0; x < size; x += block) {
+        // The last block may be partial, as the padding must stay blank.
+        int32_t count = size - x < block ? size - x : block;
 
-    uint8_t* tmp = buffer;
-    buffer = backbuffer;
-    backbuffer = tmp;
+        for (int32_t j = 0; j < count; j++) {
+            int32_t i = x + j;
+            int32_t hue = bleed_neighbours[j] * (
+                    above[i-n] + above[i] + above[i+n] +
+                    row[i-n] + row[i+n] +
+                    below[i-n] + below[i] + below[i+n]
+                ) + bleed_center[j] * row[i];
+
+            hue /= base;
+            hue *= decay_factor[j];
+            hue /= base;
+            hue -= decay_lin[j];
+
+            target[i] = hue < 0 ? 0 : (hue > 255 ? 255 : hue);
+        }
+    }
 }
 
-void Surface::Circle(int32_t x, int32_t y, uint32_t r) {
-    uint32_t r2 = r * r;
-    uint32_t dx, dx2, dy;
-    for (dx = 0; dx <= r; dx++) {
-        dx2 = dx * dx;
-        for (dy = 0; dx2 + dy*dy <= r2; dy++) {
-            SetClipped(x + dx, y + dy, 255);
-            SetClipped(x + dx, y - dy, 255);
-            SetClipped(x - dx, y + dy, 255);
-            SetClipped(x - dx, y - dy, 255);
+void Surface::DecayInterleavedSeparable(const uint8_t* row, uint8_t* target) {
+    const int32_t n = interleaved_channels;
+    const int32_t block = 4 * n;
+    const int32_t radius = guard;
+
+    int32_t kernel[guard + 1][block], decay_factor[block], decay_lin[block];
+
+    for (int32_t j = 0; j < block; j++) {
+        const LayerDecay& decay(layer_decay[j % n]);
+
+        for (int32_t k = 0; k <= radius; k++) {
+            kernel[k][j] = decay.kernel[k];
+        }
+        decay_factor[j] = decay.decay_factor;
+        decay_lin[j] = decay.decay_lin;
+    }
+
+    int32_t* column = &columns[guard * n];
+    int32_t pitch = stride;
+
+    // Blocks start on a pixel boundary, so lane j always belongs to channel
+    // j % n.
+    int32_t first = -radius * n,
+            last = (static_cast<int32_t>(width) + radius) * n;
+
+    for (int32_t x = first; x < last; x += block) {
+        int32_t count = last - x < block ? last - x : block;
+
+        for (int32_t j = 0; j < count; j++) {
+            int32_t i = x + j,
+                    sum = kernel[0][j] * row[i];
+
+            for (int32_t k = 1; k <= radius; k++) {
+                sum += kernel[k][j] * (row[i - k * pitch] + row[i + k * pitch]);
+            }
+
+            column[i] = sum;
+        }
+    }
+
+    int32_t size = width * n;
+
+    for (int32_t x = 0; x < size; x += block) {
+        int32_t count = size - x < block ? size - x : block;
+
+        for (int32_t j = 0; j < count; j++) {
+            int32_t i = x + j;
+            int32_t hue = kernel[0][j] * column[i];
+
+            for (int32_t k = 1; k <= radius; k++) {
+                hue += kernel[k][j] * (column[i - k * n] + column[i + k * n]);
+            }
+
+            hue /= base;
+            hue *= decay_factor[j];
+            hue /= base;
+            hue -= decay_lin[j];
+
+            target[i] = hue < 0 ? 0 : (hue > 255 ? 255 : hue);
         }
     }
 }
 
-void Surface::Line(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t r) {
-    if (x1 >= width || x2 >= width || y1 >= height || y2 >= height) return;
+void Surface::Stamp(
+    const uint8_t* kernel, uint32_t size,
+    int32_t x, int32_t y, uint8_t intensity)
+{
+    int32_t extent = static_cast<int32_t>(size);
 
-    int32_t dx = x2 - x1,
-            dy = y2 - y1;
-    int32_t stepx = dx > 0 ? 1 : -1,
-            stepy = dy > 0 ? 1 : -1;
-    int32_t x = x1 - stepx, y = y1, ny;
+    // Rejecting kernels entirely off the surface first keeps the arithmetic
+    // below from overflowing.
+    if (x <= -extent || y <= -extent ||
+        x >= static_cast<int32_t>(width) || y >= static_cast<int32_t>(height))
+    {
+        return;
+    }
+
+    int32_t x0 = x < 0 ? -x : 0,
+            y0 = y < 0 ? -y : 0,
+            x1 = extent,
+            y1 = extent;
+
+    if (x + x1 > static_cast<int32_t>(width)) x1 = width - x;
+    if (y + y1 > static_cast<int32_t>(height)) y1 = height - y;
+    if (x0 >= x1 || y0 >= y1) return;
+
+    // Using 256 as scale for full intensity makes the multiplication exact.
+    uint32_t scale = intensity + 1;
+
+    for (int32_t ky = y0; ky < y1; ky++) {
+        const uint8_t* source = kernel + ky * size + x0;
+        uint8_t* target = buffer + (y + ky) * stride + (x + x0) * channels;
+        int32_t count = x1 - x0;
 
-    while (static_cast<uint32_t>(x) != x2) {
-        x += stepx;
-        y -= stepy;
-        ny = (dx != 0 ? y1 + (dy * (x - static_cast<int32_t>(x1))) / dx : y2);
-        while (y != ny) {
-            y += stepy;
-            Circle(x, y, r);
-       };
-    };
+        if (channels > 1) {
+            for (int32_t i = 0; i < count; i++) {
+                uint8_t value = (source[i] * scale) >> 8;
+                uint8_t& pixel(target[i * channels]);
+                if (pixel < value) pixel = value;
+            }
+            continue;
+        }
+
+        // The inner loop is branchless so the compiler can vectorize it.
+        for (int32_t i = 0; i < count; i++) {
+            uint8_t value = (source[i] * scale) >> 8;
+            target[i] = target[i] > value ? target[i] : value;
+        }
+    }
 }
 
 }
@@ -26,6 +26,7 @@
 #define GLOW_SURFACE_H
 
 #include <stdint.h>
+#include <vector>
 
 namespace glow {
 
@@ -33,22 +34,55 @@ namespace glow {
  * The Surface class implements a 8-bit grayscale framebuffer and the provides
  * surface transformation and a couple of drawing operations. There is nothing
  * NaCl specific here, so documentation is more sparse. Sorry :)
+ *
+ * A surface consists of one or more layers, each with its own pair of
+ * planes. The layers are decayed together in one pass, each with its own
+ * parameters. Drawing operations and the pixel accessors work on the selected
+ * layer.
+ *
+ * Alternatively, up to four layers can be interleaved in a single pair of
+ * planes, one channel of a four byte pixel per layer. With three layers, this
+ * is an RGB surface whose pixels have the byte order of an RGBA image; the
+ * fourth channel is kept blank. The interleaved stencil processes the
+ * channels of a pixel together, each with the parameters of its layer.
+ *
+ * All planes live in a single allocation. Rows are 64 byte aligned and
+ * padded to the stride, which leaves room for guard columns on both sides,
+ * and each plane has blank guard rows above and below. The padding is never
+ * drawn to, so the stencils in Decay can read up to guard pixels beyond each
+ * edge without clipping.
  */
 class Surface {
     public:
 
-        Surface(uint32_t width, uint32_t height);
+        struct DecayParameters {
+            float bleed, decay_exp;
+            uint8_t decay_lin;
+        };
+
+        /**
+         * The fixed point form of the decay parameters of all layers for a
+         * number of steps, see below.
+         */
+        class DecayPlan;
+
+        Surface(
+            uint32_t width,
+            uint32_t height,
+            uint32_t layers = 1,
+            bool interleaved = false
+        );
         ~Surface();
 
         uint32_t Get(uint32_t x, uint32_t y) const {
-            return buffer[y * width + x];
+            return buffer[y * stride + x * channels];
         }
 
         uint32_t GetClipped(int32_t x, int32_t y) const {
             if (x >= 0 && static_cast<uint32_t>(x) < width &&
                y >= 0 && static_cast<uint32_t>(y) < height)
             {
-                return buffer[y * width + x];
+                return buffer[y * stride + x * channels];
             } else {
                 return 0;
             }
@@ -56,38 +90,271 @@ class Surface {
         }
 
         void Set(uint32_t x, uint32_t y, uint32_t hue) {
-            buffer[y * width + x] = hue;
+            buffer[y * stride + x * channels] = hue;
         }
 
         void SetClipped(int32_t x, int32_t y, uint32_t hue) {
             if (x >= 0 && static_cast<uint32_t>(x) < width &&
                 y >= 0 && static_cast<uint32_t>(y) < height)
             {
-                buffer[y * width + x] = hue;
+                buffer[y * stride + x * channels] = hue;
             }
         }
 
+        uint32_t GetWidth() const {
+            return width;
+        }
+
+        uint32_t GetHeight() const {
+            return height;
+        }
+
         uint32_t GetArea() const {
             return area;
         }
 
+        /**
+         * The distance between two rows in bytes.
+         */
+        uint32_t GetStride() const {
+            return stride;
+        }
+
+        uint32_t GetLayers() const {
+            return layers;
+        }
+
+        bool IsInterleaved() const {
+            return channels > 1;
+        }
+
+        /**
+         * The number of bytes per pixel in a plane.
+         */
+        uint32_t GetChannels() const {
+            return channels;
+        }
+
+        /**
+         * The number of planes which make up the current state, either one
+         * per layer or a single interleaved one.
+         */
+        uint32_t GetPlanes() const {
+            return planes.size() / 2;
+        }
+
+        /**
+         * The number of bytes in a row of a plane (excluding padding).
+         */
+        uint32_t GetRowSize() const {
+            return width * channels;
+        }
+
+        void SelectLayer(uint32_t layer) {
+            selected = layer < layers ? layer : layers - 1;
+            buffer = LayerBuffer(selected);
+        }
+
+        /**
+         * The first pixel of the selected layer in the current plane. The
+         * plane is height * stride bytes in size, consecutive pixels of the
+         * layer are GetChannels() bytes apart.
+         */
         uint8_t* GetBuffer() {
             return buffer;
         }
 
-        void Decay(float bleed, float decay_exp, uint8_t decay_lin);
-        void Line(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t r);
-        void Circle(int32_t x, int32_t y, uint32_t r);
+        const uint8_t* GetBuffer() const {
+            return buffer;
+        }
+
+        /**
+         * The first row of the current state of the given plane.
+         */
+        uint8_t* GetBuffer(uint32_t plane) {
+            return planes[2 * plane + front];
+        }
+
+        const uint8_t* GetBuffer(uint32_t plane) const {
+            return planes[2 * plane + front];
+        }
+
+        /**
+         * The stride used for a surface of the given width.
+         */
+        static uint32_t StrideForWidth(uint32_t width, uint32_t channels = 1);
+
+        /**
+         * Clear all layers.
+         */
+        void Clear();
+
+        /**
+         * Advance all layers by the given number of decay steps in a single
+         * pass. There is one set of parameters per layer.
+         *
+         * If exact is set, up to GetPipelineSteps() steps are applied one
+         * after the other, but the intermediate states only live in a few
+         * cache resident rows (see DecayPipeline). This saves memory
+         * bandwidth, not arithmetic. Otherwise, or beyond that, the
+         * exponential and linear decay are composed exactly (up to
+         * rounding), while repeated bleeding is approximated by a wider
+         * separable kernel. A single step is always exact.
+         */
+        void Decay(
+            const DecayParameters* parameters,
+            uint32_t steps = 1,
+            bool exact = true
+        );
+
+        /**
+         * Preparing the decay involves floating point math, so callers which
+         * decay with the same parameters every frame can prepare a plan once
+         * and keep it. A plan may only be used with the surface which has
+         * prepared it.
+         */
+        void PrepareDecay(
+            const DecayParameters* parameters,
+            uint32_t steps,
+            bool exact,
+            DecayPlan& plan
+        ) const;
+        void Decay(const DecayPlan& plan);
+
+        uint32_t GetPipelineSteps() const {
+            return pipeline_steps;
+        }
+
+        /**
+         * Blend a square coverage kernel scaled by intensity into the surface,
+         * keeping the maximum of both. The kernel is clipped at the edges.
+         */
+        void Stamp(
+            const uint8_t* kernel, uint32_t size,
+            int32_t x, int32_t y, uint8_t intensity
+        );
 
     private:
 
-        uint32_t width, height, area;
-        uint8_t* buffer, *backbuffer;
+        static const uint32_t alignment = 64;
+        static const uint32_t interleaved_channels = 4;
+        /**
+         * The number of guard rows and columns, which is also the maximum
+         * radius of the separable decay kernel. Wider kernels would cost
+         * more than the frame they are supposed to catch up with.
+         */
+        static const uint32_t guard = 2;
+
+        /**
+         * Extra offset between consecutive planes, so corresponding pixels
+         * don't map to the same cache set if the plane size is a power of
+         * two.
+         */
+        static const uint32_t plane_stagger = 2048 + alignment;
+
+        /**
+         * Each intermediate state of the decay pipeline is kept in a buffer
+         * of pipeline_rows rows. The number of steps is limited by the
+         * number of buffers which fit into pipeline_budget bytes, which is
+         * sized for the L2 cache.
+         */
+        static const uint32_t pipeline_rows = 16;
+        static const uint32_t pipeline_budget = 256 * 1024;
+        static const uint32_t max_pipeline_steps = 8;
+
+        /**
+         * The fixed point representation of the parameters of one layer for
+         * a single Decay call. Depending on the total bleed, either the
+         * stencil or the separable kernel is used. The kernel is always
+         * prepared, as interleaved channels must share the method.
+         */
+        struct LayerDecay {
+            bool separable;
+            int32_t bleed_neighbours, bleed_center;
+            int32_t kernel[guard + 1];
+            int32_t decay_factor, decay_lin;
+        };
+
+        uint32_t width, height, area, channels, stride, layers;
+        uint8_t* arena;
+
+        /**
+         * The two planes of layer i are planes[2 * i] and planes[2 * i + 1],
+         * front selects the current one. Interleaved layers share the first
+         * pair. buffer points to the selected layer in the current plane.
+         */
+        std::vector<uint8_t*> planes;
+        uint32_t front, selected;
+        uint8_t* buffer;
+
+        /**
+         * Scratch row for the vertical pass of the multi step decay. There
+         * is one LayerDecay per layer or, if interleaved, per channel.
+         */
+        std::vector<int32_t> columns;
+        std::vector<LayerDecay> layer_decay;
+
+        /**
+         * The buffers of the decay pipeline, one per intermediate state.
+         * Each is preceded by a blank row, like the planes.
+         */
+        uint32_t pipeline_steps;
+        std::vector<uint8_t> pipeline_arena;
+        uint8_t* pipeline;
+
+        uint8_t* LayerBuffer(uint32_t layer) {
+            return channels > 1 ?
+                planes[front] + layer : planes[2 * layer + front];
+        }
+
+        bool PrepareLayers(
+            const DecayParameters* parameters,
+            uint32_t steps,
+            bool exact,
+            std::vector<LayerDecay>& decay
+        ) const;
+        void PrepareLayer(
+            const DecayParameters& parameters,
+            uint32_t steps,
+            LayerDecay& decay
+        ) const;
+        void ApplyDecay(uint32_t steps, bool pipelined);
+        void DecayRow(uint32_t plane, const uint8_t* row, uint8_t* target);
+        void DecayPipeline(uint32_t plane, uint32_t steps);
+        void DecayStencil(
+            const uint8_t* row,
+            uint8_t* target,
+            const LayerDecay& decay
+        );
+        void DecaySeparable(
+            const uint8_t* row,
+            uint8_t* target,
+            const LayerDecay& decay
+        );
+        void DecayInterleavedStencil(const uint8_t* row, uint8_t* target);
+        void DecayInterleavedSeparable(const uint8_t* row, uint8_t* target);
 
         Surface(const Surface&);
         const Surface& operator=(const Surface&);
 };
 
+class Surface::DecayPlan {
+    public:
+
+        DecayPlan() :
+            steps(0),
+            pipelined(true)
+        {}
+
+    private:
+
+        friend class Surface;
+
+        uint32_t steps;
+        bool pipelined;
+        std::vector<Surface::LayerDecay> layers;
+};
+
 }
 
 #endif // GLOW_SURFACE_H
@@ -0,0 +1,717 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Correctness and performance tests for Surface and Brush. Both have no NaCl
+ * dependencies, so this is built with the host compiler: `make test`.
+ *
+ * The optimized kernels are compared to a straightforward scalar reference
+ * over randomized surfaces, parameters and strokes. The reference keeps the
+ * original implementation of Decay, and of Circle and Line, which now only
+ * draw the test content. The timing tests compare the cost of
+ * the kernels to the reference and to each other, see timing_baseline
+ * below.
+ *
+ * Usage: surface_test [seed] [--no-timing]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <sys/time.h>
+
+#include "surface.h"
+#include "brush.h"
+
+using glow::Surface;
+using glow::Brush;
+
+namespace {
+
+uint32_t checks = 0, failures = 0;
+
+void Check(bool condition, const char* what, uint32_t iteration) {
+    checks++;
+    if (condition) return;
+
+    failures++;
+    if (failures <= 20) printf("FAIL: %s (iteration %u)\n", what, iteration);
+}
+
+/**
+ * A small LCG, so a seed reproduces the same cases everywhere.
+ */
+class Random {
+    public:
+
+        Random(uint32_t seed) : state(seed * 2654435761u + 1) {}
+
+        uint32_t Next() {
+            state = state * 1664525 + 1013904223;
+            return state >> 8;
+        }
+
+        uint32_t Below(uint32_t limit) {
+            return Next() % limit;
+        }
+
+        int32_t Between(int32_t low, int32_t high) {
+            return low + static_cast<int32_t>(Below(high - low + 1));
+        }
+
+        float Unit() {
+            return static_cast<float>(Next() & 0xffff) / 0xffff;
+        }
+
+    private:
+
+        uint32_t state;
+};
+
+/**
+ * A single layer surface with the original scalar drawing and decay code.
+ * Stamp is the plain form of Surface::Stamp.
+ */
+class Reference {
+    public:
+
+        Reference(uint32_t width, uint32_t height) :
+            width(width),
+            height(height),
+            pixels(width * height, 0)
+        {}
+
+        uint32_t Get(int32_t x, int32_t y) const {
+            if (x < 0 || y < 0 ||
+                x >= static_cast<int32_t>(width) ||
+                y >= static_cast<int32_t>(height))
+            {
+                return 0;
+            }
+
+            return pixels[y * width + x];
+        }
+
+        void Max(int32_t x, int32_t y, uint8_t hue) {
+            if (x < 0 || y < 0 ||
+                x >= static_cast<int32_t>(width) ||
+                y >= static_cast<int32_t>(height))
+            {
+                return;
+            }
+
+            uint8_t& pixel(pixels[y * width + x]);
+            if (pixel < hue) pixel = hue;
+        }
+
+        void Decay(const Surface::DecayParameters& parameters);
+        void Circle(int32_t x, int32_t y, uint32_t r, uint8_t intensity);
+        void Line(
+            uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2,
+            uint32_t r, uint8_t intensity
+        );
+        void Stamp(
+            const uint8_t* kernel, uint32_t size,
+            int32_t x, int32_t y, uint8_t intensity
+        );
+
+        uint32_t width, height;
+        std::vector<uint8_t> pixels;
+};
+
+void Reference::Decay(const Surface::DecayParameters& parameters) {
+    const uint32_t base = 1 << 20;
+
+    float bleed = parameters.bleed,
+          decay_exp = parameters.decay_exp;
+    uint8_t decay_lin = parameters.decay_lin;
+
+    int32_t bleed_neighbours = nearbyint(bleed / 8. * static_cast<float>(base)),
+            bleed_center = nearbyint((1. - bleed) * static_cast<float>(base)),
+            decay_factor = nearbyint((1. - decay_exp) * static_cast<float>(base));
+
+    std::vector<uint8_t> target(pixels.size());
+
+    for (uint32_t x = 0; x < width; x++) {
+        for (uint32_t y = 0; y < height; y++) {
+            int32_t hue = 0;
+
+            if (bleed_neighbours > 0) {
+                hue += bleed_neighbours * (
+                    Get(x-1, y-1) + Get(x, y-1) + Get(x+1, y-1) +
+                    Get(x-1, y) + Get(x+1, y) +
+                    Get(x-1, y+1) + Get(x, y+1) + Get(x+1, y+1)
+                );
+                hue += bleed_center * Get(x, y);
+                hue /= base;
+            } else {
+                hue = Get(x, y);
+            }
+            hue *= decay_factor;
+            hue /= base;
+            hue -= decay_lin;
+
+            target[y * width + x] = hue < 0 ? 0 : (hue > 255 ? 255 : hue);
+        }
+    }
+
+    pixels.swap(target);
+}
+
+void Reference::Circle(int32_t x, int32_t y, uint32_t r, uint8_t intensity) {
+    int32_t ir = r;
+
+    for (int32_t dx = -ir; dx <= ir; dx++) {
+        for (int32_t dy = -ir; dy <= ir; dy++) {
+            if (dx * dx + dy * dy <= ir * ir) Max(x + dx, y + dy, intensity);
+        }
+    }
+}
+
+void Reference::Line(
+    uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2,
+    uint32_t r, uint8_t intensity)
+{
+    if (x1 >= width || x2 >= width || y1 >= height || y2 >= height) return;
+
+    int32_t dx = x2 - x1,
+            dy = y2 - y1;
+    int32_t stepx = dx > 0 ? 1 : -1,
+            stepy = dy > 0 ? 1 : -1;
+    int32_t x = x1 - stepx, y = y1, ny;
+
+    while (static_cast<uint32_t>(x) != x2) {
+        x += stepx;
+        y -= stepy;
+        ny = (dx != 0 ? y1 + (dy * (x - static_cast<int32_t>(x1))) / dx : y2);
+        while (y != ny) {
+            y += stepy;
+            Circle(x, y, r, intensity);
+        }
+    }
+}
+
+void Reference::Stamp(
+    const uint8_t* kernel, uint32_t size,
+    int32_t x, int32_t y, uint8_t intensity)
+{
+    for (uint32_t ky = 0; ky < size; ky++) {
+        for (uint32_t kx = 0; kx < size; kx++) {
+            uint32_t value = kernel[ky * size + kx] * (intensity + 1) >> 8;
+            Max(x + kx, y + ky, value);
+        }
+    }
+}
+
+/**
+ * A surface with a reference for each of its layers.
+ */
+struct Case {
+    Case(uint32_t width, uint32_t height, uint32_t layers, bool interleaved) :
+        surface(width, height, layers, interleaved),
+        references(layers, Reference(width, height)),
+        parameters(layers)
+    {}
+
+    bool Matches() {
+        for (uint32_t l = 0; l < references.size(); l++) {
+            surface.SelectLayer(l);
+            for (uint32_t y = 0; y < surface.GetHeight(); y++) {
+                for (uint32_t x = 0; x < surface.GetWidth(); x++) {
+                    if (surface.Get(x, y) != references[l].Get(x, y)) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * The largest absolute difference to the reference.
+     */
+    uint32_t Distance() {
+        uint32_t distance = 0;
+
+        for (uint32_t l = 0; l < references.size(); l++) {
+            surface.SelectLayer(l);
+            for (uint32_t y = 0; y < surface.GetHeight(); y++) {
+                for (uint32_t x = 0; x < surface.GetWidth(); x++) {
+                    int32_t d = static_cast<int32_t>(surface.Get(x, y)) -
+                        static_cast<int32_t>(references[l].Get(x, y));
+                    if (d < 0) d = -d;
+                    if (static_cast<uint32_t>(d) > distance) distance = d;
+                }
+            }
+        }
+
+        return distance;
+    }
+
+    void ReferenceDecay(uint32_t steps) {
+        for (uint32_t i = 0; i < steps; i++) {
+            for (uint32_t l = 0; l < references.size(); l++) {
+                references[l].Decay(parameters[l]);
+            }
+        }
+    }
+
+    Surface surface;
+    std::vector<Reference> references;
+    std::vector<Surface::DecayParameters> parameters;
+};
+
+/**
+ * Sizes are mostly small, with a bias towards the edge cases: one pixel
+ * wide or high, and odd widths which don't fill a vector.
+ */
+uint32_t RandomExtent(Random& random) {
+    switch (random.Below(4)) {
+        case 0: return 1;
+        case 1: return 1 + random.Below(8);
+        case 2: return 2 * random.Below(40) + 1;
+        default: return 1 + random.Below(96);
+    }
+}
+
+Surface::DecayParameters RandomParameters(Random& random) {
+    Surface::DecayParameters parameters;
+
+    switch (random.Below(4)) {
+        case 0: parameters.bleed = 0; break;
+        case 1: parameters.bleed = 1; break;
+        default: parameters.bleed = random.Unit();
+    }
+    parameters.decay_exp = random.Below(3) == 0 ? 0 : random.Unit() * .2;
+    parameters.decay_lin = random.Below(4);
+
+    return parameters;
+}
+
+/**
+ * Fill the selected layer with random circles and lines drawn by the
+ * reference, then draw stamps on both, many of them partly or entirely off
+ * the surface.
+ */
+void RandomStrokes(Random& random, Case& c, uint32_t layer, uint32_t count) {
+    Surface& surface(c.surface);
+    Reference& reference(c.references[layer]);
+    int32_t width = surface.GetWidth(),
+            height = surface.GetHeight();
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t intensity = random.Below(256);
+
+        if (random.Below(2) == 0) {
+            int32_t x = random.Between(-width - 20, 2 * width + 20),
+                    y = random.Between(-height - 20, 2 * height + 20);
+            uint32_t r =
+                random.Below(4) == 0 ? random.Below(256) : random.Below(8);
+
+            reference.Circle(x, y, r, intensity);
+        } else {
+            // Line drops strokes with an endpoint off the surface.
+            uint32_t x1 = random.Below(width + 2),
+                     y1 = random.Below(height + 2),
+                     x2 = random.Below(width + 2),
+                     y2 = random.Below(height + 2);
+
+            reference.Line(x1, y1, x2, y2, random.Below(6), intensity);
+        }
+    }
+
+    surface.SelectLayer(layer);
+    for (int32_t y = 0; y < height; y++) {
+        for (int32_t x = 0; x < width; x++) surface.Set(x, y, reference.Get(x, y));
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t intensity = random.Below(256);
+        uint32_t size = 1 + random.Below(12);
+        std::vector<uint8_t> kernel(size * size);
+        for (uint32_t k = 0; k < kernel.size(); k++) {
+            kernel[k] = random.Below(256);
+        }
+
+        int32_t x = random.Between(-width - 16, width + 16),
+                y = random.Between(-height - 16, height + 16);
+
+        surface.Stamp(&kernel[0], size, x, y, intensity);
+        reference.Stamp(&kernel[0], size, x, y, intensity);
+    }
+}
+
+Case* RandomCase(Random& random) {
+    uint32_t layers = 1 + random.Below(4);
+    bool interleaved = random.Below(2) == 0;
+
+    Case* c = new Case(
+        RandomExtent(random), RandomExtent(random), layers, interleaved);
+
+    for (uint32_t l = 0; l < layers; l++) {
+        c->parameters[l] = RandomParameters(random);
+        RandomStrokes(random, *c, l, 1 + random.Below(12));
+    }
+
+    return c;
+}
+
+void TestDrawing(Random& random, uint32_t iteration) {
+    Case* c = RandomCase(random);
+
+    Check(c->Matches(), "stamps match the reference", iteration);
+
+    delete c;
+}
+
+void TestDecay(Random& random, uint32_t iteration) {
+    Case* c = RandomCase(random);
+    Surface& surface(c->surface);
+
+    // A single step is exact, whatever the method.
+    surface.Decay(&c->parameters[0], 1, random.Below(2) == 0);
+    c->ReferenceDecay(1);
+    Check(c->Matches(), "single decay step matches the reference", iteration);
+
+    // So are the steps within the reach of the pipeline.
+    uint32_t steps = 1 + random.Below(surface.GetPipelineSteps());
+    surface.Decay(&c->parameters[0], steps, true);
+    c->ReferenceDecay(steps);
+    Check(c->Matches(), "pipelined decay matches the reference", iteration);
+
+    // A prepared plan is the same as a direct call.
+    Surface::DecayPlan plan;
+    surface.PrepareDecay(&c->parameters[0], steps, true, plan);
+    surface.Decay(plan);
+    c->ReferenceDecay(steps);
+    Check(c->Matches(), "prepared decay matches the reference", iteration);
+
+    delete c;
+}
+
+/**
+ * The composed catch-up is only an approximation. Without bleed, it differs
+ * from the repeated steps by rounding only.
+ */
+void TestCatchUp(Random& random, uint32_t iteration) {
+    Case* c = RandomCase(random);
+    Surface& surface(c->surface);
+    uint32_t steps = 2 + random.Below(30);
+
+    for (uint32_t l = 0; l < c->parameters.size(); l++) {
+        c->parameters[l].bleed = 0;
+    }
+
+    surface.Decay(&c->parameters[0], steps, false);
+    c->ReferenceDecay(steps);
+    Check(c->Distance() <= steps, "catch-up without bleed is close to the "
+        "reference", iteration);
+
+    // Whatever the bleed, a blank surface stays blank.
+    Case blank(RandomExtent(random), RandomExtent(random), 1, false);
+    blank.parameters[0] = RandomParameters(random);
+    blank.surface.Decay(&blank.parameters[0], steps, false);
+    Check(blank.Matches(), "catch-up keeps a blank surface blank", iteration);
+
+    delete c;
+}
+
+/**
+ * The anti-aliased brush has no reference, so we check where it draws: only
+ * near the segment, and always on it unless the brush is thinner than a
+ * pixel.
+ */
+void TestBrush(Random& random, uint32_t iteration) {
+    uint32_t width = RandomExtent(random),
+             height = RandomExtent(random);
+    Surface surface(width, height);
+    Brush brush;
+
+    uint32_t r = random.Below(4) == 0 ? random.Below(300) : random.Below(10);
+    float spread = 3 * (r + width + height),
+          x1 = (random.Unit() - .3) * spread,
+          y1 = (random.Unit() - .3) * spread,
+          x2 = (random.Unit() - .3) * spread,
+          y2 = (random.Unit() - .3) * spread;
+
+    // Like the renderer, start the stroke with a dot, as Line doesn't stamp
+    // the start point.
+    brush.Dot(surface, x1, y1, r, 255);
+    brush.Line(surface, x1, y1, x2, y2, r, 255);
+
+    float dx = x2 - x1,
+          dy = y2 - y1,
+          length2 = dx * dx + dy * dy,
+          reach = (r > Brush::max_radius ? Brush::max_radius : r) + 2;
+    bool near = true, covered = true;
+
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float t = length2 > 0 ? ((x - x1) * dx + (y - y1) * dy) / length2 : 0;
+            if (t < 0) t = 0;
+            if (t > 1) t = 1;
+
+            float ex = x1 + t * dx - x,
+                  ey = y1 + t * dy - y,
+                  distance = sqrtf(ex * ex + ey * ey);
+
+            if (surface.Get(x, y) > 0 && distance > reach) near = false;
+            if (surface.Get(x, y) == 0 && distance < .5 && r > 0) {
+                covered = false;
+            }
+        }
+    }
+
+    Check(near, "brush draws only near the line", iteration);
+    Check(covered, "brush covers the line", iteration);
+
+    // Degenerate input is dropped.
+    Surface blank(width, height);
+    brush.Line(blank, NAN, 0, 1, 1, r, 255);
+    brush.Line(blank, 0, INFINITY, 1, 1, r, 255);
+    brush.Dot(blank, -1e30, 1e30, r, 255);
+    bool empty = true;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) empty = empty && !blank.Get(x, y);
+    }
+    Check(empty, "brush ignores invalid coordinates", iteration);
+}
+
+double Now() {
+    timeval time;
+    gettimeofday(&time, NULL);
+
+    return time.tv_sec + time.tv_usec * 1e-6;
+}
+
+/**
+ * The stored timing baseline: the largest acceptable cost of a kernel
+ * relative to a second one, measured in the same run. Ratios keep the
+ * thresholds independent of the machine. They leave headroom over what
+ * an x86-64 host measures at -O2 on a 1280x720 surface, see the comments.
+ */
+struct Timing {
+    const char* name;
+    double limit;
+};
+
+const Timing timing_baseline[] = {
+    // About .3: the stencil vectorizes, the reference doesn't.
+    {"single step vs. reference", .5},
+    // 1.1 - 1.5: the separable kernel takes two passes.
+    {"catch-up vs. single step", 2},
+    // About 1: the pipeline saves memory bandwidth, not arithmetic, and
+    // only pays off if the memory is slower than the stencil.
+    {"pipelined steps vs. single steps", 1.3},
+    // 1.2 - 2: three layers are interleaved into four channels.
+    {"interleaved vs. planar layers", 2.5},
+    // About .5: the inner loop vectorizes.
+    {"stamps vs. reference", 1}
+};
+
+/**
+ * The number of calls which take at least 20ms, so the resolution of the
+ * clock doesn't matter.
+ */
+template<typename Operation> uint32_t Calibrate(Operation& operation) {
+    uint32_t repeats = 1;
+
+    while (true) {
+        double start = Now();
+        for (uint32_t i = 0; i < repeats; i++) operation();
+        if (Now() - start >= .02) return repeats;
+
+        repeats *= 2;
+    }
+}
+
+template<typename Operation> double Run(Operation& operation, uint32_t repeats) {
+    double start = Now();
+    for (uint32_t i = 0; i < repeats; i++) operation();
+
+    return (Now() - start) / repeats;
+}
+
+/**
+ * The cost of an operation relative to a second one. The runs of both
+ * alternate, and the best of several runs is least affected by other
+ * processes.
+ */
+template<typename Operation, typename Relative>
+double Ratio(Operation& operation, Relative& relative) {
+    uint32_t repeats = Calibrate(operation),
+             relative_repeats = Calibrate(relative);
+    double best = 1e30, relative_best = 1e30;
+
+    for (uint32_t run = 0; run < 7; run++) {
+        double cost = Run(operation, repeats),
+               relative_cost = Run(relative, relative_repeats);
+
+        if (cost < best) best = cost;
+        if (relative_cost < relative_best) relative_best = relative_cost;
+    }
+
+    return best / relative_best;
+}
+
+struct DecayOperation {
+    DecayOperation(
+        Surface& surface,
+        float bleed, uint32_t steps, bool exact,
+        uint32_t calls = 1
+    ) :
+        surface(surface),
+        steps(steps),
+        calls(calls),
+        exact(exact)
+    {
+        Surface::DecayParameters parameters = {bleed, .05, 1};
+        this->parameters.assign(surface.GetLayers(), parameters);
+    }
+
+    void operator()() {
+        for (uint32_t i = 0; i < calls; i++) {
+            surface.Decay(&parameters[0], steps, exact);
+        }
+    }
+
+    Surface& surface;
+    uint32_t steps, calls;
+    bool exact;
+    std::vector<Surface::DecayParameters> parameters;
+};
+
+struct ReferenceDecayOperation {
+    ReferenceDecayOperation(Reference& reference) : reference(reference) {}
+
+    void operator()() {
+        Surface::DecayParameters parameters = {.8, .05, 1};
+        reference.Decay(parameters);
+    }
+
+    Reference& reference;
+};
+
+template<typename Target> struct StampsOperation {
+    StampsOperation(Target& target) : target(target), kernel(35 * 35) {
+        for (uint32_t i = 0; i < kernel.size(); i++) kernel[i] = i * 7;
+    }
+
+    void operator()() {
+        for (int32_t i = 0; i < 2000; i++) {
+            target.Stamp(&kernel[0], 35,
+                (i * 37) % 700 - 50, (i * 53) % 500 - 50, i);
+        }
+    }
+
+    Target& target;
+    std::vector<uint8_t> kernel;
+};
+
+void Fill(Surface& surface, Reference* reference) {
+    Random random(1);
+
+    for (uint32_t l = 0; l < surface.GetLayers(); l++) {
+        surface.SelectLayer(l);
+        for (uint32_t y = 0; y < surface.GetHeight(); y++) {
+            for (uint32_t x = 0; x < surface.GetWidth(); x++) {
+                uint8_t hue = random.Below(256);
+                surface.Set(x, y, hue);
+                if (reference) reference->pixels[y * reference->width + x] = hue;
+            }
+        }
+    }
+}
+
+void CheckTiming(uint32_t index, double ratio) {
+    const Timing& timing(timing_baseline[index]);
+
+    printf("timing: %-34s %.2f (limit %.2f)\n", timing.name, ratio, timing.limit);
+    Check(ratio <= timing.limit, timing.name, 0);
+}
+
+void TestTiming() {
+    const uint32_t width = 1280, height = 720;
+
+    Surface surface(width, height);
+    Reference reference(width, height);
+    Fill(surface, &reference);
+
+    DecayOperation single(surface, .8, 1, true);
+    ReferenceDecayOperation reference_single(reference);
+    CheckTiming(0, Ratio(single, reference_single));
+
+    DecayOperation catch_up(surface, .2, 8, false);
+    CheckTiming(1, Ratio(catch_up, single));
+
+    uint32_t steps = surface.GetPipelineSteps();
+    DecayOperation pipelined(surface, .2, steps, true),
+        single_steps(surface, .2, 1, true, steps);
+    CheckTiming(2, Ratio(pipelined, single_steps));
+
+    Surface interleaved(width, height, 3, true), planar(width, height, 3);
+    Fill(interleaved, NULL);
+    Fill(planar, NULL);
+    DecayOperation interleaved_decay(interleaved, .8, 1, true),
+        planar_decay(planar, .8, 1, true);
+    CheckTiming(3, Ratio(interleaved_decay, planar_decay));
+
+    StampsOperation<Surface> stamps(surface);
+    StampsOperation<Reference> reference_stamps(reference);
+    CheckTiming(4, Ratio(stamps, reference_stamps));
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint32_t seed = 1;
+    bool timing = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-timing") == 0) {
+            timing = false;
+        } else {
+            seed = strtoul(argv[i], NULL, 10);
+        }
+    }
+
+    printf("seed %u\n", seed);
+    Random random(seed);
+
+    for (uint32_t i = 0; i < 500; i++) {
+        TestDrawing(random, i);
+        TestDecay(random, i);
+        TestCatchUp(random, i);
+        TestBrush(random, i);
+    }
+
+    if (timing) TestTiming();
+
+    printf("%u checks, %u failures\n", checks, failures);
+
+    return failures > 0 ? 1 : 0;
+}
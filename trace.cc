@@ -0,0 +1,207 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "trace.h"
+
+#include <sys/time.h>
+#include <cstdio>
+
+namespace {
+
+/**
+ * The name of each phase and the track (thread) it is displayed on.
+ */
+const char* phase_names[glow::Tracer::PHASE_COUNT] = {
+    "input",
+    "pump",
+    "decay",
+    "draw",
+    "publish",
+    "convert",
+    "flush",
+    "flush callback",
+    "display latency"
+};
+
+const uint32_t phase_threads[glow::Tracer::PHASE_COUNT] = {
+    1, 2, 2, 2, 2, 3, 3, 3, 3
+};
+
+const char* thread_names[] = {
+    NULL,
+    "main",
+    "simulation",
+    "presentation"
+};
+
+const uint32_t thread_count = 4;
+
+}
+
+namespace glow {
+
+Tracer::Tracer(uint32_t process) :
+    process(process),
+    ring(NULL),
+    next(0),
+    first(0),
+    enabled(0),
+    origin(0)
+{}
+
+Tracer::~Tracer() {
+    delete[] ring;
+}
+
+/**
+ * The ring is never released while the tracer lives, so a thread which has
+ * seen the enabled flag can always write to it.
+ */
+void Tracer::Start() {
+    if (ring == NULL) {
+        ring = new Record[ring_size];
+
+        for (uint32_t i = 0; i < ring_size; i++) ring[i].sequence = 0;
+    }
+
+    first = next;
+    origin = Now();
+
+    __sync_synchronize();
+    enabled = 1;
+}
+
+void Tracer::Stop() {
+    enabled = 0;
+}
+
+int64_t Tracer::Now() {
+    timeval current;
+    if (gettimeofday(&current, NULL) != 0) return 0;
+
+    return static_cast<int64_t>(current.tv_sec) * 1000000 + current.tv_usec;
+}
+
+/**
+ * Claim the next record and invalidate it while it is written, see Logger.
+ */
+void Tracer::Append(
+    Phase phase,
+    int64_t timestamp,
+    int64_t value,
+    Type type)
+{
+    uint32_t index = __sync_fetch_and_add(&next, 1);
+    Record& record(ring[index % ring_size]);
+
+    record.sequence = 0;
+    __sync_synchronize();
+
+    record.phase = phase;
+    record.type = type;
+    record.timestamp = timestamp;
+    record.value = value;
+
+    __sync_synchronize();
+    record.sequence = index + 1;
+}
+
+/**
+ * Timestamps are microseconds since the trace was started. The records are
+ * copied before being checked, so a record which is overwritten in between
+ * fails the check.
+ */
+void Tracer::Dump(std::string& json) const {
+    char event[160];
+
+    json += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    snprintf(event, sizeof(event),
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+        "\"args\":{\"name\":\"glow %u\"}}",
+        static_cast<unsigned>(process), static_cast<unsigned>(process));
+    json += event;
+
+    for (uint32_t i = 1; i < thread_count; i++) {
+        snprintf(event, sizeof(event),
+            ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+            "\"args\":{\"name\":\"%s\"}}",
+            static_cast<unsigned>(process), static_cast<unsigned>(i),
+            thread_names[i]);
+        json += event;
+    }
+
+    uint32_t end = next,
+             begin = end - first > ring_size ? end - ring_size : first;
+
+    for (uint32_t index = begin; ring != NULL && index != end; index++) {
+        const Record& slot(ring[index % ring_size]);
+
+        if (slot.sequence != index + 1) continue;
+        __sync_synchronize();
+
+        Record record;
+        record.phase = slot.phase;
+        record.type = slot.type;
+        record.timestamp = slot.timestamp;
+        record.value = slot.value;
+
+        __sync_synchronize();
+        if (slot.sequence != index + 1 || record.phase >= PHASE_COUNT) continue;
+
+        // Events which began before a restart are dropped.
+        if (record.timestamp < origin) continue;
+
+        double timestamp = record.timestamp - origin;
+
+        if (record.type == TYPE_INSTANT) {
+            snprintf(event, sizeof(event),
+                ",{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,"
+                "\"tid\":%u,\"ts\":%.0f}",
+                phase_names[record.phase], static_cast<unsigned>(process),
+                static_cast<unsigned>(phase_threads[record.phase]),
+                timestamp);
+        } else if (record.type == TYPE_COUNTER) {
+            // Counters are tracks of the process, in microseconds.
+            snprintf(event, sizeof(event),
+                ",{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%u,"
+                "\"ts\":%.0f,\"args\":{\"us\":%.0f}}",
+                phase_names[record.phase], static_cast<unsigned>(process),
+                timestamp, static_cast<double>(record.value));
+        } else {
+            snprintf(event, sizeof(event),
+                ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                "\"ts\":%.0f,\"dur\":%.0f}",
+                phase_names[record.phase], static_cast<unsigned>(process),
+                static_cast<unsigned>(phase_threads[record.phase]),
+                timestamp, static_cast<double>(record.value));
+        }
+
+        json += event;
+    }
+
+    json += "]}";
+}
+
+}
@@ -0,0 +1,172 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_TRACE_H
+#define GLOW_TRACE_H
+
+#include <stdint.h>
+#include <string>
+
+namespace glow {
+
+/**
+ * The Tracer records the phases of the main loop for offline analysis. Events
+ * are written to a lock-free ring buffer with preallocated records from any
+ * thread, overwriting the oldest ones once the ring is full. Dump serializes
+ * the ring in the JSON format understood by chrome://tracing and Perfetto,
+ * with one track per thread and one per counter.
+ *
+ * Tracing is opt-in. While disabled, recording costs a single load, and the
+ * ring is only allocated when tracing is started for the first time.
+ */
+class Tracer {
+    public:
+
+        /**
+         * The thread of an event is implied by its phase: input arrives on
+         * the main thread, pumping (the work posted to the renderer), decay,
+         * drawing and publishing run on the simulation thread and the rest
+         * on the presentation thread.
+         */
+        enum Phase {
+            PHASE_INPUT,
+            PHASE_PUMP,
+            PHASE_DECAY,
+            PHASE_DRAW,
+            PHASE_PUBLISH,
+            PHASE_CONVERT,
+            PHASE_FLUSH,
+            PHASE_FLUSH_CALLBACK,
+            PHASE_DISPLAY_LATENCY,
+            PHASE_COUNT
+        };
+
+        /**
+         * Records the enclosing block as a complete event.
+         */
+        class Scope {
+            public:
+
+                Scope(Tracer& tracer, Phase phase) :
+                    tracer(tracer),
+                    phase(phase),
+                    begin(tracer.enabled ? Now() : 0)
+                {}
+
+                ~Scope() {
+                    if (begin > 0) tracer.Append(phase, begin, Now() - begin);
+                }
+
+            private:
+
+                Tracer& tracer;
+                Phase phase;
+                int64_t begin;
+
+                Scope(const Scope&);
+                const Scope& operator=(const Scope&);
+        };
+
+        /**
+         * The process id identifies the instance in the trace.
+         */
+        explicit Tracer(uint32_t process);
+        ~Tracer();
+
+        /**
+         * Start and Stop must be called from the main thread. Starting
+         * discards the events recorded so far.
+         */
+        void Start();
+        void Stop();
+
+        bool IsEnabled() const {
+            return enabled;
+        }
+
+        /**
+         * Record an event without duration.
+         */
+        void Instant(Phase phase) {
+            if (enabled) Append(phase, Now(), -1, TYPE_INSTANT);
+        }
+
+        /**
+         * Record a sample of a value which is displayed as a graph.
+         */
+        void Counter(Phase phase, int64_t value) {
+            if (enabled) Append(phase, Now(), value, TYPE_COUNTER);
+        }
+
+        /**
+         * Append the recorded events as a JSON trace. Events which are
+         * overwritten while dumping are skipped.
+         */
+        void Dump(std::string& json) const;
+
+    private:
+
+        friend class Scope;
+
+        static const uint32_t ring_size = 16384;
+
+        enum Type {
+            TYPE_COMPLETE,
+            TYPE_INSTANT,
+            TYPE_COUNTER
+        };
+
+        /**
+         * The sequence number is one past the index of the event the record
+         * holds, or zero while it is written. The value is the duration of a
+         * complete event or the sample of a counter.
+         */
+        struct Record {
+            volatile uint32_t sequence;
+            uint16_t phase, type;
+            int64_t timestamp;
+            int64_t value;
+        };
+
+        uint32_t process;
+        Record* ring;
+        volatile uint32_t next, first;
+        volatile uint32_t enabled;
+        int64_t origin;
+
+        static int64_t Now();
+        void Append(
+            Phase phase,
+            int64_t timestamp,
+            int64_t value,
+            Type type = TYPE_COMPLETE
+        );
+
+        Tracer(const Tracer&);
+        const Tracer& operator=(const Tracer&);
+};
+
+}
+
+#endif // GLOW_TRACE_H
@@ -0,0 +1,99 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "triple_buffer.h"
+
+#include <cstring>
+
+namespace glow {
+
+TripleBuffer::TripleBuffer(uint32_t size) :
+    size(size),
+    back(0),
+    front(1),
+    shared(2)
+{
+    for (uint32_t i = 0; i < 3; i++) {
+        slots[i].buffer = new uint8_t[size];
+        slots[i].timestamp = 0;
+        slots[i].completion = 0;
+        memset(slots[i].buffer, 0, size);
+    }
+}
+
+TripleBuffer::~TripleBuffer() {
+    for (uint32_t i = 0; i < 3; i++) delete[] slots[i].buffer;
+}
+
+/**
+ * Atomically replace the shared word and return its previous value. We use a
+ * compare-and-swap loop as __sync_lock_test_and_set is not guaranteed to
+ * support arbitrary values on all targets. The GCC builtins imply a full
+ * memory barrier, so the frame data is visible before the index is.
+ */
+uint32_t TripleBuffer::Exchange(uint32_t value) {
+    uint32_t expected;
+
+    do {
+        expected = shared;
+    } while (__sync_val_compare_and_swap(&shared, expected, value) != expected);
+
+    return expected;
+}
+
+/**
+ * If the latest frame has not been acquired yet, it is dropped, and the new
+ * frame inherits its input timestamp if that one is older. Otherwise the
+ * latency of the dropped input would go unreported. The timestamp has to be
+ * stored before the swap, so we retry if the consumer acquires the frame in
+ * the meantime.
+ */
+void TripleBuffer::Publish(int64_t timestamp, int64_t completion) {
+    uint32_t expected;
+
+    do {
+        expected = shared;
+
+        int64_t oldest = timestamp;
+        if (expected & fresh_flag) {
+            int64_t dropped = slots[expected & index_mask].timestamp;
+            if (dropped > 0 && (oldest == 0 || dropped < oldest)) oldest = dropped;
+        }
+
+        slots[back].timestamp = oldest;
+        slots[back].completion = completion;
+    } while (__sync_val_compare_and_swap(&shared, expected, back | fresh_flag)
+        != expected);
+
+    back = expected & index_mask;
+}
+
+bool TripleBuffer::Acquire() {
+    if (!(shared & fresh_flag)) return false;
+
+    front = Exchange(front) & index_mask;
+    return true;
+}
+
+}
@@ -0,0 +1,109 @@
+/**
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013 Christian Speckner <cnspeckn@googlemail.com>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GLOW_TRIPLE_BUFFER_H
+#define GLOW_TRIPLE_BUFFER_H
+
+#include <stdint.h>
+
+namespace glow {
+
+/**
+ * The TripleBuffer class hands intensity frames from a single producer thread
+ * to a single consumer thread without locking. Each side owns one of the
+ * three slots exclusively, while the third slot holds the latest completed
+ * frame. Publishing and acquiring a frame atomically swap the private slot
+ * with the shared one, so the producer never waits for the consumer and the
+ * consumer always picks up the most recent frame.
+ */
+class TripleBuffer {
+    public:
+
+        TripleBuffer(uint32_t size);
+        ~TripleBuffer();
+
+        /**
+         * Producer side: the back slot may be written freely until Publish
+         * is called. The timestamps (of the oldest input and of completion)
+         * travel along with the frame. A frame which replaces one that was
+         * never acquired keeps the older input timestamp.
+         */
+        uint8_t* GetBackBuffer() {
+            return slots[back].buffer;
+        }
+        void Publish(int64_t timestamp, int64_t completion);
+
+        /**
+         * Consumer side: Acquire returns false if no new frame has been
+         * published since the last call; otherwise the front slot is replaced
+         * by the latest frame.
+         */
+        bool Acquire();
+
+        const uint8_t* GetFrontBuffer() const {
+            return slots[front].buffer;
+        }
+
+        int64_t GetFrontTimestamp() const {
+            return slots[front].timestamp;
+        }
+
+        int64_t GetFrontCompletion() const {
+            return slots[front].completion;
+        }
+
+        uint32_t GetSize() const {
+            return size;
+        }
+
+    private:
+
+        struct Slot {
+            uint8_t* buffer;
+            int64_t timestamp, completion;
+        };
+
+        /**
+         * The two lower bits of the shared word hold the index of the
+         * latest slot, the fresh flag signals that it has not been acquired
+         * yet.
+         */
+        static const uint32_t index_mask = 0x03;
+        static const uint32_t fresh_flag = 0x04;
+
+        uint32_t size;
+        Slot slots[3];
+
+        uint32_t back, front;
+        volatile uint32_t shared;
+
+        uint32_t Exchange(uint32_t value);
+
+        TripleBuffer(const TripleBuffer&);
+        const TripleBuffer& operator=(const TripleBuffer&);
+};
+
+}
+
+#endif // GLOW_TRIPLE_BUFFER_H